@@ -15,6 +15,21 @@
 
 namespace nise {
 
+    // An istream over a buffer read in place, e.g. an upload, instead of
+    // a copy in a stringstream.  The buffer must outlive the stream.
+    class MemoryInputStream: public std::istream {
+        struct Buf: public std::streambuf {
+            Buf (const char *begin, const char *end) {
+                setg(const_cast<char *>(begin), const_cast<char *>(begin), const_cast<char *>(end));
+            }
+        } buf;
+    public:
+        MemoryInputStream (const char *begin, const char *end)
+            : std::istream(0), buf(begin, end) {
+            rdbuf(&buf);
+        }
+    };
+
     // I/O routines
     static inline uint16_t ReadUint16 (std::istream &is) {
         uint16_t v;
@@ -28,6 +43,12 @@ namespace nise {
         return v;
     }
 
+    static inline uint64_t ReadUint64 (std::istream &is) {
+        uint64_t v;
+        is.read((char *)&v, sizeof(v));
+        return v;
+    }
+
     static inline void WriteUint32 (std::ostream &os, uint32_t v) {
         os.write((char *)&v, sizeof(v));
     }
@@ -90,6 +111,43 @@ namespace nise {
         }
     }
 
+    // LEB128 varints, with zigzag for signed values
+    static inline void AppendVarint (std::string *buf, uint64_t v) {
+        while (v >= 0x80) {
+            buf->push_back(char(v | 0x80));
+            v >>= 7;
+        }
+        buf->push_back(char(v));
+    }
+
+    static inline void AppendVarintSigned (std::string *buf, int64_t v) {
+        AppendVarint(buf, (uint64_t(v) << 1) ^ uint64_t(v >> 63));
+    }
+
+    // Returns false if the input ends before the varint does.
+    static inline bool ParseVarint (const char **p, const char *end, uint64_t *v) {
+        uint64_t r = 0;
+        unsigned shift = 0;
+        while (*p < end) {
+            uint8_t c = uint8_t(*(*p)++);
+            r |= uint64_t(c & 0x7F) << shift;
+            if ((c & 0x80) == 0) {
+                *v = r;
+                return true;
+            }
+            shift += 7;
+            if (shift >= 64) break;
+        }
+        return false;
+    }
+
+    static inline bool ParseVarintSigned (const char **p, const char *end, int64_t *v) {
+        uint64_t u;
+        if (!ParseVarint(p, end, &u)) return false;
+        *v = int64_t(u >> 1) ^ -int64_t(u & 1);
+        return true;
+    }
+
     class Binary;
 
     static inline void ReadFile (const std::string &path, std::string *binary) {
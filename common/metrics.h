@@ -0,0 +1,185 @@
+#ifndef WDONG_NISE_METRICS
+#define WDONG_NISE_METRICS
+
+#include <string>
+#include <algorithm>
+#include <vector>
+#include <iostream>
+#include <Poco/Timestamp.h>
+
+namespace nise {
+
+    // A lock-free histogram with power-of-two buckets: bucket i counts
+    // the values below 2^i (and not below 2^(i-1)).  Times are recorded
+    // in microseconds.
+    class Histogram {
+    public:
+        static const unsigned BUCKETS = 40;
+    private:
+        uint64_t bucket[BUCKETS];
+        uint64_t count;
+        uint64_t sum;
+    public:
+        Histogram (): count(0), sum(0) {
+            std::fill(bucket, bucket + BUCKETS, 0);
+        }
+
+        void add (uint64_t v) {
+            unsigned b = v ? 64 - __builtin_clzll(v) : 0;
+            if (b >= BUCKETS) b = BUCKETS - 1;
+            __sync_fetch_and_add(&bucket[b], 1);
+            __sync_fetch_and_add(&count, 1);
+            __sync_fetch_and_add(&sum, v);
+        }
+
+        // Prometheus text format, values scaled by unit.
+        void render (std::ostream &os, const std::string &name, const std::string &labels, double unit) const {
+            std::string sep = labels.empty() ? "" : ",";
+            uint64_t cum = 0;
+            unsigned last = BUCKETS;
+            while ((last > 0) && (bucket[last - 1] == 0)) --last;
+            for (unsigned i = 0; i < last; ++i) {
+                cum += bucket[i];
+                os << name << "_bucket{" << labels << sep << "le=\"" << double(uint64_t(1) << i) * unit << "\"} " << cum << '\n';
+            }
+            os << name << "_bucket{" << labels << sep << "le=\"+Inf\"} " << count << '\n';
+            os << name << "_sum" << (labels.empty() ? "" : "{" + labels + "}") << ' ' << sum * unit << '\n';
+            os << name << "_count" << (labels.empty() ? "" : "{" + labels + "}") << ' ' << count << '\n';
+        }
+    };
+
+    class Counter {
+        uint64_t value;
+    public:
+        Counter (): value(0) {
+        }
+
+        void add (uint64_t v = 1) {
+            __sync_fetch_and_add(&value, v);
+        }
+
+        uint64_t get () const {
+            return value;
+        }
+    };
+
+    // Runtime instrumentation of the search, exported by the server at
+    // /metrics.  The members are updated from any thread.
+    class Metrics {
+        static Metrics inst;
+    public:
+        // stages of a search, in microseconds
+        Histogram parse;        // form and upload parsing
+        Histogram download;
+        Histogram extract_wait; // queued for an extraction thread
+        Histogram decode;       // JPEG decoding
+        Histogram sift;
+        Histogram sketch;
+        Histogram plan;         // fbi planning
+        Histogram scan_io;
+        Histogram scan_cpu;
+        Histogram verify;
+        Histogram expansion;
+        Histogram serialize;
+        Histogram search;       // Session::run as a whole
+
+        Histogram scan_bytes;   // bytes read per query image
+
+        Counter image_hit, image_miss;
+        Counter retrieval_hit, retrieval_miss;
+        Counter session_hit, session_miss;
+        Counter store_hit, store_miss;
+        Counter session_expired, session_evicted;
+
+        Counter admit_degraded, admit_overloaded, admit_rejected;
+
+        Counter log_dropped_records, log_dropped_lines;
+
+        Counter extract_rejected, extract_expired, extract_timeout, extract_failed;
+
+        Counter prefetch_loaded, prefetch_dropped;
+
+        static Metrics &instance () {
+            return inst;
+        }
+
+        static void gauge (std::ostream &os, const std::string &name, const std::string &help, double value) {
+            os << "# HELP " << name << ' ' << help << '\n';
+            os << "# TYPE " << name << " gauge\n";
+            os << name << ' ' << value << '\n';
+        }
+
+        void render (std::ostream &os) const {
+            const Histogram *stages[] = {&parse, &download, &extract_wait, &decode, &sift, &sketch, &plan,
+                                         &scan_io, &scan_cpu, &verify, &expansion, &serialize, &search};
+            const char *names[] = {"parse", "download", "extract_wait", "decode", "sift", "sketch", "plan",
+                                   "scan_io", "scan_cpu", "verify", "expansion", "serialize", "search"};
+            os << "# HELP nise_stage_seconds Time spent in each stage of a search.\n";
+            os << "# TYPE nise_stage_seconds histogram\n";
+            for (unsigned i = 0; i < sizeof(stages) / sizeof(stages[0]); ++i) {
+                stages[i]->render(os, "nise_stage_seconds", std::string("stage=\"") + names[i] + '"', 1e-6);
+            }
+
+            os << "# HELP nise_query_scan_bytes Bytes read from the sketch database per query.\n";
+            os << "# TYPE nise_query_scan_bytes histogram\n";
+            scan_bytes.render(os, "nise_query_scan_bytes", "", 1);
+
+            const Counter *caches[][2] = {{&image_hit, &image_miss},
+                                          {&retrieval_hit, &retrieval_miss},
+                                          {&session_hit, &session_miss},
+                                          {&store_hit, &store_miss}};
+            const char *cache_names[] = {"image", "retrieval", "session", "store"};
+            os << "# HELP nise_cache_requests_total Cache lookups by result.\n";
+            os << "# TYPE nise_cache_requests_total counter\n";
+            for (unsigned i = 0; i < sizeof(caches) / sizeof(caches[0]); ++i) {
+                os << "nise_cache_requests_total{cache=\"" << cache_names[i] << "\",result=\"hit\"} " << caches[i][0]->get() << '\n';
+                os << "nise_cache_requests_total{cache=\"" << cache_names[i] << "\",result=\"miss\"} " << caches[i][1]->get() << '\n';
+            }
+
+            os << "# HELP nise_session_evictions_total Sessions dropped from the cache by reason.\n";
+            os << "# TYPE nise_session_evictions_total counter\n";
+            os << "nise_session_evictions_total{reason=\"expired\"} " << session_expired.get() << '\n';
+            os << "nise_session_evictions_total{reason=\"memory\"} " << session_evicted.get() << '\n';
+
+            os << "# HELP nise_log_dropped_total Log entries dropped because the writer fell behind.\n";
+            os << "# TYPE nise_log_dropped_total counter\n";
+            os << "nise_log_dropped_total{kind=\"record\"} " << log_dropped_records.get() << '\n';
+            os << "nise_log_dropped_total{kind=\"access\"} " << log_dropped_lines.get() << '\n';
+
+            os << "# HELP nise_extract_dropped_total Query images not extracted, by reason.\n";
+            os << "# TYPE nise_extract_dropped_total counter\n";
+            os << "nise_extract_dropped_total{reason=\"full\"} " << extract_rejected.get() << '\n';
+            os << "nise_extract_dropped_total{reason=\"deadline\"} " << extract_expired.get() << '\n';
+            os << "nise_extract_dropped_total{reason=\"timeout\"} " << extract_timeout.get() << '\n';
+            os << "nise_extract_dropped_total{reason=\"failed\"} " << extract_failed.get() << '\n';
+
+            os << "# HELP nise_prefetch_containers_total Containers loaded ahead of thumbnail requests.\n";
+            os << "# TYPE nise_prefetch_containers_total counter\n";
+            os << "nise_prefetch_containers_total " << prefetch_loaded.get() << '\n';
+            os << "# HELP nise_prefetch_dropped_total Prefetch requests dropped because the queue was full.\n";
+            os << "# TYPE nise_prefetch_dropped_total counter\n";
+            os << "nise_prefetch_dropped_total " << prefetch_dropped.get() << '\n';
+
+            os << "# HELP nise_admission_total Searches admitted at reduced quality or rejected.\n";
+            os << "# TYPE nise_admission_total counter\n";
+            os << "nise_admission_total{level=\"degraded\"} " << admit_degraded.get() << '\n';
+            os << "nise_admission_total{level=\"overloaded\"} " << admit_overloaded.get() << '\n';
+            os << "nise_admission_total{level=\"rejected\"} " << admit_rejected.get() << '\n';
+        }
+    };
+
+    // Adds the lifetime of the object to a histogram.
+    class StageTimer {
+        Histogram &hist;
+        Poco::Timestamp start;
+    public:
+        StageTimer (Histogram &h): hist(h) {
+        }
+
+        ~StageTimer () {
+            hist.add(start.elapsed());
+        }
+    };
+}
+
+#endif
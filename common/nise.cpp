@@ -1,11 +1,22 @@
+#include <map>
+#include <vector>
+#include <cerrno>
+#include <poll.h>
+#include <boost/lexical_cast.hpp>
 #include <Poco/Pipe.h>
-#include <Poco/PipeStream.h>
 #include <Poco/Process.h>
-#include <Poco/StreamCopier.h>
 #include <Poco/SHA1Engine.h>
 #include <Poco/File.h>
+#include <Poco/URI.h>
+#include <Poco/Mutex.h>
+#include <Poco/ScopedLock.h>
+#include <Poco/Timestamp.h>
+#include <Poco/Net/HTTPClientSession.h>
+#include <Poco/Net/HTTPRequest.h>
+#include <Poco/Net/HTTPResponse.h>
 #include <fbi.h>
 #include "nise.h"
+#include "metrics.h"
 #include <char_bit_cnt.inc>
 
 namespace nise {
@@ -17,6 +28,13 @@ namespace nise {
     Signature Signature::RECORD("reco");
     Signature Signature::MAPPING("mapp");
     Signature Signature::CONTAINER("cont");
+    Signature Signature::GRAPH("grap");
+    Signature Signature::RESULT("rslt");
+    Signature Signature::RETRIEVAL("retr");
+    Signature Signature::PROJECTION("lshp");
+    Signature Signature::CLUSTER("clus");
+
+    Metrics Metrics::inst;
 
     Extension2Mime Extension2Mime::instance;
 
@@ -35,18 +53,211 @@ namespace nise {
     }
 
 
-    void Download (const std::string &url, std::string *file) {
+    // Keep-alive connections to the hosts queries were recently downloaded
+    // from, so that bursts of URL searches against the same site do not
+    // each pay for a new connection.
+    class HTTPSessionPool {
+        typedef std::map<std::string, std::vector<Poco::Net::HTTPClientSession *> > Map;
+        Poco::FastMutex mutex;
+        Map idle;
+    public:
+        static HTTPSessionPool instance;
+
+        ~HTTPSessionPool () {
+            BOOST_FOREACH(Map::value_type &v, idle) {
+                BOOST_FOREACH(Poco::Net::HTTPClientSession *s, v.second) {
+                    delete s;
+                }
+            }
+        }
+
+        // *reused is set if the connection has served a request before
+        Poco::Net::HTTPClientSession *get (const std::string &host, unsigned short port, bool *reused) {
+            std::string key = host + ':' + boost::lexical_cast<std::string>(port);
+            {
+                Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+                Map::iterator it = idle.find(key);
+                if ((it != idle.end()) && !it->second.empty()) {
+                    Poco::Net::HTTPClientSession *s = it->second.back();
+                    it->second.pop_back();
+                    *reused = true;
+                    return s;
+                }
+            }
+            *reused = false;
+            Poco::Net::HTTPClientSession *s = new Poco::Net::HTTPClientSession(host, port);
+            s->setKeepAlive(true);
+            return s;
+        }
+
+        void put (Poco::Net::HTTPClientSession *s) {
+            std::string key = s->getHost() + ':' + boost::lexical_cast<std::string>(s->getPort());
+            {
+                Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+                std::vector<Poco::Net::HTTPClientSession *> &v = idle[key];
+                if (v.size() < DOWNLOAD_IDLE_SESSIONS) {
+                    v.push_back(s);
+                    return;
+                }
+            }
+            delete s;
+        }
+    };
+
+    HTTPSessionPool HTTPSessionPool::instance;
+
+    // wget is still used for the schemes Poco::Net does not speak (https),
+    // with the same limits: the output is read as it comes, and wget is
+    // killed once it passes MAX_UPLOAD_SIZE or DOWNLOAD_TIMEOUT since start.
+    static void Spawn (const std::string &url, const Poco::Timestamp &start, std::string *file) {
             Poco::Pipe inPipe;
             std::vector<std::string> args;
             args.push_back("--output-document=-");
             args.push_back("--tries=1");
+            args.push_back("--timeout=" + boost::lexical_cast<std::string>(DOWNLOAD_TIMEOUT / 1000));
+            args.push_back("--max-redirect=" + boost::lexical_cast<std::string>(DOWNLOAD_REDIRECTS));
             args.push_back(url);
             Poco::ProcessHandle sub(Poco::Process::launch("wget",
                         args, 0, &inPipe, 0));
-            Poco::PipeInputStream input(inPipe);
-            Poco::StreamCopier::copyToString(input, *file);
+            bool failed = false;
+            char buf[UPLOAD_BUFFER_SIZE];
+            try {
+                for (;;) {
+                    Poco::Timestamp::TimeDiff left = Poco::Timestamp::TimeDiff(DOWNLOAD_TIMEOUT) * 1000 - start.elapsed();
+                    if (left <= 0) {
+                        failed = true;
+                        break;
+                    }
+                    struct pollfd pfd;
+                    pfd.fd = inPipe.readHandle();
+                    pfd.events = POLLIN;
+                    pfd.revents = 0;
+                    int r = poll(&pfd, 1, int((left + 999) / 1000));
+                    if ((r < 0) && (errno == EINTR)) continue;
+                    if (r <= 0) {
+                        failed = true;
+                        break;
+                    }
+                    int n = inPipe.readBytes(buf, sizeof(buf));
+                    if (n <= 0) break;      // wget is done
+                    file->append(buf, n);
+                    if (file->size() > MAX_UPLOAD_SIZE) {
+                        failed = true;
+                        break;
+                    }
+                }
+            }
+            catch (const Poco::Exception &) {
+                failed = true;
+            }
+            if (failed) {
+                try {
+                    Poco::Process::kill(sub.id());
+                }
+                catch (const Poco::Exception &) {   // already gone
+                }
+            }
             inPipe.close(Poco::Pipe::CLOSE_READ);
-            sub.wait();
+            // a partial body comes with a non-zero exit
+            if ((sub.wait() != 0) || failed) file->clear();
+    }
+
+    // One request.  Returns the HTTP status, with the body in file if 200
+    // or the target in location if a redirect; 0 if the download failed.
+    static int Fetch (const Poco::URI &uri, const Poco::Timestamp &start, std::string *file, std::string *location) {
+        for (unsigned attempt = 0; ; ++attempt) {
+            bool reused;
+            Poco::Net::HTTPClientSession *session
+                = HTTPSessionPool::instance.get(uri.getHost(), uri.getPort(), &reused);
+            try {
+                Poco::Timestamp::TimeDiff left = Poco::Timestamp::TimeDiff(DOWNLOAD_TIMEOUT) * 1000 - start.elapsed();
+                if (left <= 0) {
+                    delete session;
+                    return 0;
+                }
+                session->setTimeout(Poco::Timespan(left));
+                std::string path = uri.getPathAndQuery();
+                Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_GET,
+                        path.empty() ? "/" : path, Poco::Net::HTTPMessage::HTTP_1_1);
+                request.setKeepAlive(true);
+                session->sendRequest(request);
+                Poco::Net::HTTPResponse response;
+                std::istream &is = session->receiveResponse(response);
+                int status = response.getStatus();
+                if (status != Poco::Net::HTTPResponse::HTTP_OK) {
+                    // not worth draining the body to keep the connection
+                    *location = response.get("Location", "");
+                    delete session;
+                    return status;
+                }
+                if (response.hasContentLength() && (response.getContentLength() > std::streamsize(MAX_UPLOAD_SIZE))) {
+                    delete session;
+                    return 0;
+                }
+                file->clear();
+                char buf[UPLOAD_BUFFER_SIZE];
+                for (;;) {
+                    is.read(buf, sizeof(buf));
+                    file->append(buf, is.gcount());
+                    if (!is) break;
+                    if ((file->size() > MAX_UPLOAD_SIZE)
+                            || start.isElapsed(Poco::Timestamp::TimeDiff(DOWNLOAD_TIMEOUT) * 1000)) {
+                        file->clear();
+                        delete session;
+                        return 0;
+                    }
+                }
+                if (file->size() > MAX_UPLOAD_SIZE) {
+                    file->clear();
+                    delete session;
+                    return 0;
+                }
+                if (is.eof() && response.getKeepAlive()) {
+                    HTTPSessionPool::instance.put(session);
+                }
+                else {
+                    delete session;
+                }
+                return status;
+            }
+            catch (const Poco::Exception &) {
+                delete session;
+                file->clear();
+                // the host might have closed an idle connection
+                if (!reused || attempt > 0) return 0;
+            }
+        }
+    }
+
+    void Download (const std::string &url, std::string *file) {
+        Poco::Timestamp start;
+        file->clear();
+        try {
+            Poco::URI uri(url);
+            for (unsigned hop = 0; hop <= DOWNLOAD_REDIRECTS; ++hop) {
+                if (uri.getScheme() == "https") {
+                    Spawn(uri.toString(), start, file);
+                    return;
+                }
+                if (uri.getScheme() != "http") return;
+                std::string location;
+                int status = Fetch(uri, start, file, &location);
+                if (status == Poco::Net::HTTPResponse::HTTP_OK) return;
+                file->clear();
+                if (((status == Poco::Net::HTTPResponse::HTTP_MOVED_PERMANENTLY)
+                            || (status == Poco::Net::HTTPResponse::HTTP_FOUND)
+                            || (status == Poco::Net::HTTPResponse::HTTP_SEE_OTHER)
+                            || (status == Poco::Net::HTTPResponse::HTTP_TEMPORARY_REDIRECT))
+                        && !location.empty()) {
+                    uri.resolve(location);
+                    continue;
+                }
+                return;
+            }
+        }
+        catch (const Poco::Exception &) {
+            file->clear();
+        }
     }
 
     void Checksum (const std::string &data, std::string *checksum) {
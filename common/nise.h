@@ -36,6 +36,11 @@ namespace nise {
     static const unsigned SKETCH_DIST_OFFLINE = 3;
     static const unsigned UPLOAD_BUFFER_SIZE = 8192;
     static const unsigned MAX_UPLOAD_SIZE = 1 * MEGA;
+    static const unsigned BATCH_MAX_SIZE = 64 * MEGA;   // body of /search/batch
+    static const unsigned BATCH_MAX_ITEMS = 4096;
+    static const unsigned DOWNLOAD_TIMEOUT = 10000;     // miliseconds, whole download
+    static const unsigned DOWNLOAD_REDIRECTS = 5;
+    static const unsigned DOWNLOAD_IDLE_SESSIONS = 4;   // kept alive per host
 
     static const unsigned MAX_HASH = 20000;
 
@@ -53,14 +58,59 @@ namespace nise {
 
     static const unsigned MAX_INITIAL_RESULTS = 2000;
     static const unsigned MAX_INITIAL_RESULTS_FOR_EXPAND = 1000;
+    static const unsigned MAX_RANKED_RESULTS = 2000;
+    static const unsigned EARLY_STOP_STABLE = 20;
+    static const unsigned EARLY_STOP_TOP = 10;
+    static const float EARLY_STOP_MARGIN = 1.0F;
+
+    static const unsigned VERIFY_TIME_DEFAULT = 200;
+    static const unsigned VERIFY_ITERATIONS = 100;
+    static const float VERIFY_POSITION_TOLERANCE = 0.05F;
+    static const float VERIFY_SCALE_TOLERANCE = 0.5F;
+    static const int VERIFY_MIN_INLIERS = 4;   // to be promoted by verification
     static const float NIBBLE_ALPHA = 0.5F;
     static const float NIBBLE_EPSILON = 0.00001F;
     static const unsigned NIBBLE_MAXIT = 1000;
+    static const unsigned NIBBLE_CACHE_MIN_DEGREE = 5;
 
     static const unsigned RECORD_CACHE_DEFAULT = 1024;
     static const unsigned RETRIEVAL_CACHE_DEFAULT = 1024;
+    static const unsigned RETRIEVAL_STORE_DEFAULT = 4096;  // MB
+    static const unsigned RETRIEVAL_STORE_WARM = 256;
+    static const unsigned RETRIEVAL_STORE_QUEUE = 256;   // saves waiting for the writer
     static const unsigned SESSION_EXPIRE_DEFAULT = 60000;
+    static const unsigned SESSION_MEMORY_DEFAULT = 1024;   // MB
+    static const unsigned LOG_QUEUE_DEFAULT = 4096;
+    static const unsigned EXTRACT_QUEUE_DEFAULT = 64;
+    static const unsigned EXTRACT_DEADLINE_DEFAULT = 5000;
+    static const unsigned EXTRACT_TIMEOUT_DEFAULT = 30000;     // ms a started job is waited for
+    static const unsigned LOG_FLUSH_INTERVAL = 50;
+    static const uint64_t LOG_SEGMENT_SIZE = 256 << 20;
     static const unsigned TIME_LIMIT_DEFAULT = 1000;
+    static const unsigned SEARCH_POLL_INTERVAL = 10;
+    static const unsigned BATCH_SIZE_DEFAULT = 256;
+    static const unsigned RESPONSE_BUFFER_KEEP = 1024 * 1024;
+    static const unsigned STATIC_MAX_AGE = 365 * 24 * 3600;
+    static const unsigned ADMISSION_RESERVE = 2;
+    static const unsigned ADMISSION_FEATURES = MAX_FEATURES / 2;
+    static const unsigned ADMISSION_LATENCY = 1500;
+    static const unsigned SERVER_QUEUE_DEFAULT = 64;
+    static const unsigned PREFETCH_QUEUE_DEFAULT = 256;
+    static const unsigned RANDOM_MIN_DEGREE = 5;
+    // epoll front end, see server/event.h
+    static const unsigned EVENT_IO_THREADS_DEFAULT = 2;
+    static const unsigned EVENT_PIPELINE_DEFAULT = 16;
+    static const unsigned EVENT_IDLE_DEFAULT = 60000;           // miliseconds
+    static const unsigned EVENT_CONNECTIONS_DEFAULT = 65536;
+    static const unsigned EVENT_POLL_INTERVAL = 1000;           // miliseconds
+    static const unsigned EVENT_BATCH = 256;
+    static const unsigned EVENT_HEADER_MAX = 64 * 1024;
+    static const unsigned EVENT_BODY_MAX = BATCH_MAX_SIZE + MEGA;
+    static const unsigned EVENT_BUFFER_DEFAULT = 512;           // megabytes over all connections
+    static const unsigned EVENT_CHUNK_SIZE = 64 * 1024;         // of streamed responses
+    static const unsigned EVENT_STREAM_WINDOW = MEGA;           // unsent bytes of a streamed response
+    static const unsigned GENERATION_WARM_FEATURES = 4096;
+    static const char STATIC_IMMUTABLE_DEFAULT[] = "jquery.js,jquery.form.js";
 
     static const unsigned FBI_SKIP = 8;
 
@@ -157,7 +207,11 @@ namespace nise {
             WriteUint32(os, data);
         }
 
-        static Signature IMAGE, FEATURES, RECORD, MAPPING, CONTAINER;
+        void append (std::string *buf) const {
+            buf->append(reinterpret_cast<const char *>(&data), sizeof(data));
+        }
+
+        static Signature IMAGE, FEATURES, RECORD, MAPPING, CONTAINER, GRAPH, RESULT, RETRIEVAL, PROJECTION, CLUSTER;
     private:
         uint32_t data;
     };
@@ -236,6 +290,10 @@ namespace nise {
         }
     };
 
+    // Fetches a URL into file, which is left empty on any failure,
+    // including bodies over MAX_UPLOAD_SIZE and downloads taking more than
+    // DOWNLOAD_TIMEOUT.  The calling thread is blocked meanwhile; https is
+    // fetched by a wget child, as the server does not link PocoNetSSL.
     void Download (const std::string &url, std::string *file);
 
     void Checksum (const std::string &data, std::string *checksum);
@@ -256,6 +314,7 @@ namespace nise {
             map["js"] = "text/javascript";
             map["css"] = "text/css";
             map["gif"] = "image/gif";
+            map["png"] = "image/png";
             map["jpg"] = "image/jpeg";
             map["json"] = "application/json";
         }
@@ -8,6 +8,7 @@
 #include <fcntl.h>
 #else
 #include <unistd.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -32,6 +33,7 @@ static inline void omp_init_lock(omp_lock_t *lock) {}
 static inline void omp_destroy_lock(omp_lock_t *lock) {}
 static inline void omp_set_lock(omp_lock_t *lock) {}
 static inline void omp_unset_lock(omp_lock_t *lock) {}
+static inline int omp_get_num_procs() { return 1; }
 static inline void *memalign(size_t boundary, size_t size) {
 	return malloc(size);
 }
@@ -318,15 +320,18 @@ namespace fbi {
             }
         }
 
+        // The selections already in ext are overwritten in place, so a
+        // caller that keeps ext around does not allocate again.
         void lookup (const Chunk *query, unsigned skip, unsigned len, std::vector<Selection> *ext)
         {
             BOOST_VERIFY(skip % sample_skip == 0);
             unsigned pos = 0;
             Window window(sample_skip, first);
-            ext->clear();
+            ext->resize(len);
+            unsigned n = 0;
             //const Trie *cur = &trie, *next;
             unsigned cur = 0, next;
-            while (ext->size() < len) {
+            while (n < len) {
                 //std::cout << ' ' << entries[cur].range.length;
                 next = entries[cur].children;
                 if (next == 0) break;
@@ -335,13 +340,13 @@ namespace fbi {
                 window.incr();
                 pos += sample_skip;
                 if (pos % skip == 0) {
-                    ext->push_back(Selection());
-                    ext->back().push_back(entries[cur].range);
+                    ext->at(n).assign(1, entries[cur].range);
+                    ++n;
                 }
             }
-            while (ext->size() < len) {
-                ext->push_back(Selection());
-                ext->back().push_back(entries[cur].range);
+            while (n < len) {
+                ext->at(n).assign(1, entries[cur].range);
+                ++n;
             }
         }
     };
@@ -384,6 +389,27 @@ namespace fbi {
         return false;
     }
 
+    // Time (nanoseconds) and data spent by scans, summed atomically so
+    // that the scanners of one batch can share it.
+    struct ScanStat {
+        uint64_t plan;
+        uint64_t io;
+        uint64_t cpu;
+        uint64_t bytes;
+        ScanStat (): plan(0), io(0), cpu(0), bytes(0) {
+        }
+
+        static uint64_t now () {
+#ifdef WIN32
+            return 0;
+#else
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#endif
+        }
+    };
+
     class Scanner {
          int file;
          size_t buffer_size;
@@ -409,7 +435,10 @@ namespace fbi {
              file = f;
          }
 
-         void scan (const Chunk *query, Range range, unsigned sample_rate, unsigned dist, std::vector<Key> *result, omp_lock_t *lock = 0)
+         // Reads with pread, so concurrent scanners may share a file.
+         // A non-null stop flag is polled once per block; the scan
+         // returns early, with a partial result, once it is raised.
+         void scan (const Chunk *query, Range range, unsigned sample_rate, unsigned dist, std::vector<Key> *result, omp_lock_t *lock = 0, const volatile bool *stop = 0, ScanStat *st = 0)
          {
             BOOST_VERIFY(file >= 0);
 
@@ -432,29 +461,35 @@ namespace fbi {
 
 #ifdef WIN32
             pos -= _lseeki64(file, pos, SEEK_SET);
-#else
-            pos -= lseek(file, pos, SEEK_SET);
-#endif
             BOOST_VERIFY(pos == 0);
+#endif
 
             while ((total_size > 0) && (cnt > 0)) {
+                if (stop && *stop) return;
                 if (total_size < batch_size) {
                     batch_size = total_size;
                 }
                 BOOST_VERIFY(read_offset + batch_size <= buffer_size);
 
                 char *begin = region;
+                uint64_t t0 = st ? ScanStat::now() : 0;
 #ifdef WIN32
                 ssize_t s = _read(file, begin + read_offset, batch_size);
 #else
-                ssize_t s = read(file, begin + read_offset, batch_size);
+                ssize_t s = pread(file, begin + read_offset, batch_size, pos);
 #endif
+                uint64_t t1 = st ? ScanStat::now() : 0;
+                if (st && (s > 0)) {
+                    __sync_fetch_and_add(&st->io, t1 - t0);
+                    __sync_fetch_and_add(&st->bytes, uint64_t(s));
+                }
                 
                 if (s < 0) {
                     std::cerr << strerror(errno) << std::endl;
                 }
                 //BOOST_VERIFY(s > 0);
                 if (s <= 0) break;
+                pos += s;
                 total_size -= size_t(s);
 
                 size_t left_over = (read_offset + s - skip_size) % sizeof(Point);
@@ -474,12 +509,16 @@ namespace fbi {
                         }
                         ++picked;
                         if (picked >= MAX_SCAN_RESULT) {
-                            return;
+                            break;
                         }
                     }
                     ++pt;
                     --cnt;
                 }
+                if (st) {
+                    __sync_fetch_and_add(&st->cpu, ScanStat::now() - t1);
+                }
+                if (picked >= MAX_SCAN_RESULT) return;
 
 
                 read_offset = block_size;
@@ -502,6 +541,32 @@ namespace fbi {
         std::vector<int> files;
         std::vector<unsigned> disk;
         std::vector<size_t> stat;
+        // Idle scanners, each holding a large aligned buffer, are kept
+        // for reuse, at most max_idle of them; the others are freed.
+        std::vector<Scanner *> idle;
+        unsigned max_idle;
+        omp_lock_t idle_lock;
+
+        Scanner *acquire () {
+            Scanner *scanner = 0;
+            omp_set_lock(&idle_lock);
+            if (!idle.empty()) {
+                scanner = idle.back();
+                idle.pop_back();
+            }
+            omp_unset_lock(&idle_lock);
+            return scanner ? scanner : new Scanner;
+        }
+
+        void release (Scanner *scanner) {
+            omp_set_lock(&idle_lock);
+            if (idle.size() < max_idle) {
+                idle.push_back(scanner);
+                scanner = 0;
+            }
+            omp_unset_lock(&idle_lock);
+            delete scanner;
+        }
     protected:
         unsigned getSampleRate () const {
             return sample_rate;
@@ -580,14 +645,19 @@ namespace fbi {
 
             SubPlan ZERO_SUBPLAN = {0, 0};
 
+            // Per-thread scratch; planning runs once per query feature, and
+            // with these kept the selections are only copied into pl.
             typedef boost::multi_array<SubPlan, 2> WorkSheet;
-            WorkSheet A(boost::extents[n_p][size]);
+            static thread_local WorkSheet A;
+            A.resize(boost::extents[n_p][size]);
 
-            std::vector<std::vector<Selection> > lookup(size);
-            std::vector<bool> good(size);
+            static thread_local std::vector<std::vector<Selection> > lookup;
+            static thread_local std::vector<bool> good;
+            if (lookup.size() < size) lookup.resize(size);
             // good[i] : i * step is a valid partitioning point
 
-            std::fill(good.begin(), good.end(), false);
+            good.assign(size, false);
+            pl->reset();
 
             for (unsigned i = 0; i < size; i++) {
                 if (samples[i * skip] != NULL) {
@@ -667,6 +737,8 @@ namespace fbi {
     public:
         DB (const std::string &path, bool direct = false) {
             BOOST_VERIFY(sizeof(Point) == RECORD_SIZE);
+            max_idle = omp_get_num_procs();
+            omp_init_lock(&idle_lock);
             db_size = 0;
             std::string base_dir;
             std::ifstream is(path.c_str());
@@ -719,6 +791,10 @@ namespace fbi {
         }
 
         ~DB () {
+            BOOST_FOREACH(Scanner *s, idle) {
+                delete s;
+            }
+            omp_destroy_lock(&idle_lock);
             BOOST_FOREACH(Index *s, samples) {
                 if (s) {
                     delete s;
@@ -787,17 +863,21 @@ namespace fbi {
             }
         }
 
-        void run (const Chunk *query, unsigned dist, const Plan &plan, std::vector<Key> *result) {
+        // Safe to call from several threads at once.  See Scanner::scan
+        // for the meaning of stop.
+        void run (const Chunk *query, unsigned dist, const Plan &plan, std::vector<Key> *result, const volatile bool *stop = 0, ScanStat *st = 0) {
             result->clear();
-            Scanner scanner;
+            Scanner *scanner = acquire();
             for (unsigned i = 0; i < plan.size(); ++i) {
                 if (plan[i].empty()) continue;
+                if (stop && *stop) break;
                 __sync_fetch_and_add(&stat[i], 1);
-                scanner.setFile(files[i]);
+                scanner->setFile(files[i]);
                 BOOST_FOREACH(const Range &range, plan[i]) {
-                    scanner.scan(query, range, sample_rate, dist, result);
+                    scanner->scan(query, range, sample_rate, dist, result, 0, stop, st);
                 }
             }
+            release(scanner);
             std::sort(result->begin(), result->end());
             result->resize(std::unique(result->begin(), result->end()) - result->begin());
         }
@@ -808,16 +888,27 @@ namespace fbi {
 
     public:
 
+        // If stops is given, stops[i] (may be null) is the stop flag of
+        // queries[i]: once raised the rest of that query is skipped and its
+        // result is partial.  If bytes is given, (*bytes)[i] is set to the
+        // bytes read for queries[i].
         void batch (const std::vector<Chunk *> &queries,
                 Algorithm alg, unsigned plan_dist, unsigned dist, unsigned skip,
-                std::vector<std::vector<Key> > *results) {
+                std::vector<std::vector<Key> > *results, ScanStat *st = 0,
+                const std::vector<const volatile bool *> *stops = 0,
+                std::vector<uint64_t> *bytes = 0) {
 
+            // local: the OpenMP threads below plan into it
             std::vector<Plan> plans(queries.size());
             // plan
+            uint64_t t0 = st ? ScanStat::now() : 0;
 #pragma omp parallel for default(shared)
             for (int i = 0; i < int(queries.size()); ++i) {
                 plan(queries[i], alg, plan_dist, skip, &plans[i]);
             }
+            if (st) {
+                __sync_fetch_and_add(&st->plan, ScanStat::now() - t0);
+            }
             // sort
             static const unsigned NUM_DISK = 4;
             std::vector<AccessList> all(NUM_DISK);
@@ -845,18 +936,37 @@ namespace fbi {
             for (unsigned i = 0; i < queries.size(); ++i) {
                 omp_init_lock(&locks[i]);
             }
+            // per query, summed into st afterwards
+            std::vector<ScanStat> each((st || bytes) ? queries.size() : 0);
 #pragma omp parallel for default(shared)
             for (int i = 0; i < int(NUM_DISK); ++i) {
                 std::sort(all[i].begin(), all[i].end());
-                Scanner scanner;
+                Scanner *scanner = acquire();
                 BOOST_FOREACH(Access ac, all[i]) {
-                    scanner.setFile(files[ac.file]);
-                    scanner.scan(queries[ac.query], ac.range, sample_rate, dist, &results->at(ac.query), &locks[ac.query]);
+                    const volatile bool *stop = stops ? stops->at(ac.query) : 0;
+                    if (stop && *stop) continue;
+                    scanner->setFile(files[ac.file]);
+                    scanner->scan(queries[ac.query], ac.range, sample_rate, dist, &results->at(ac.query), &locks[ac.query], stop,
+                                  each.empty() ? 0 : &each[ac.query]);
                 }
+                release(scanner);
             }
             for (unsigned i = 0; i < queries.size(); ++i) {
                 omp_destroy_lock(&locks[i]);
             }
+            if (bytes) {
+                bytes->resize(queries.size());
+            }
+            for (unsigned i = 0; i < each.size(); ++i) {
+                if (st) {
+                    __sync_fetch_and_add(&st->io, each[i].io);
+                    __sync_fetch_and_add(&st->cpu, each[i].cpu);
+                    __sync_fetch_and_add(&st->bytes, each[i].bytes);
+                }
+                if (bytes) {
+                    bytes->at(i) = each[i].bytes;
+                }
+            }
 
 #pragma omp parallel for default(shared)
             for (int i = 0; i < int(queries.size()); ++i) {
@@ -7,6 +7,7 @@ var THUMBNAIL_SIZE = 100;
 
 var result = {
     query_id: '',
+    generation: 0,
     num_results: 0,
     more_page: 0,
     results_per_page: 0
@@ -21,7 +22,7 @@ function ShortenURL (url) {
 
 function FormatResult (v) {
     var txt = '<span class="result"><span class="thumblink"><input type="hidden" value="' + v + '"/><img class="thumb" src="/thumb?id='
-            + v + '"/></span>';
+            + v + '&gen=' + result.generation + '"/></span>';
     /*
     txt += '<div class="source">';
     for (s in v.link) {
@@ -177,6 +178,7 @@ function SearchCallback (data) {
 
     $('#current_session').val(data.id);
     result.query_id = data.id;
+    result.generation = data.generation;
     result.num_results = data.num_results;
     result.more_page = Math.floor(result.num_results / result.results_per_page);
     if (data.thumb) {
@@ -1,23 +1,64 @@
 #include <algorithm>
+#include <fstream>
 #include <lshkit.h>
 #include "image.h"
 #include "extractor.h"
+#include "../common/metrics.h"
 
 namespace nise {
 
+    typedef lshkit::Sketch<lshkit::DeltaLSB<lshkit::GaussianLsh> > LshSketch;
+
+    static const unsigned PROJECTION_DIM = 128;    // Sift::dim()
+    static const unsigned PROJECTION_PROBES = 16;
+
+    // Built on first use, read-only afterwards.  The rng is default
+    // seeded, so every process gets the same projection as long as
+    // lshkit and boost generate the same numbers.
+    static LshSketch &Projection () {
+        struct Init {
+            LshSketch sketch;
+            Init () {
+                lshkit::DefaultRng rng;
+                LshSketch::Parameter pm;
+                pm.W = LSH_W;
+                pm.dim = PROJECTION_DIM;
+                sketch.reset(SKETCH_SIZE, pm, rng);
+            }
+        };
+        static Init init;
+        return init.sketch;
+    }
+
+    // Sketches of fixed pseudo-random descriptors, which identify the
+    // projection.
+    static void Fingerprint (std::string *out) {
+        LshSketch &sketch = Projection();
+        std::vector<float> desc(PROJECTION_DIM);
+        Feature probe;
+        uint32_t seed = 1;
+        out->clear();
+        for (unsigned i = 0; i < PROJECTION_PROBES; ++i) {
+            for (unsigned j = 0; j < PROJECTION_DIM; ++j) {
+                seed = seed * 1103515245 + 12345;
+                desc[j] = float((seed >> 8) & 0xFFFF) / 0x10000;
+            }
+            sketch.apply(&desc[0], probe.sketch);
+            out->append(reinterpret_cast<const char *>(probe.sketch), SKETCH_SIZE);
+        }
+    }
+
     struct ExtractorImpl {
-        typedef lshkit::Sketch<lshkit::DeltaLSB<lshkit::GaussianLsh> > LshSketch;
-        LshSketch sketch;
+        LshSketch &sketch;
         Sift xtor;
+        // buffers reused across images
+        CImg<unsigned char> im;
+        CImg<float> gray;
+        std::vector<Sift::Feature> sift;
     public:
         ExtractorImpl ()
-            : xtor(-1, 3, 0, -1, 3, -1, MIN_ENTROPY, true)
+            : sketch(Projection()), xtor(-1, 3, 0, -1, 3, -1, MIN_ENTROPY, true)
         {
-            lshkit::DefaultRng rng;
-            LshSketch::Parameter pm;
-            pm.W = LSH_W;
-            pm.dim = 128; // Sift::dim();
-            sketch.reset(SKETCH_SIZE, pm, rng);
         }
 
         void extract (const std::string &binary, Record *record, bool query) {
@@ -25,8 +66,9 @@ namespace nise {
 
             if (binary.empty()) return;
 
-            CImg<unsigned char> im;
+            Metrics &metrics = Metrics::instance();
             try {
+                StageTimer stage(metrics.decode);
                 LoadJPEG(binary, &im);
             } catch (const ImageDecodingException &) {
                 return;
@@ -39,9 +81,7 @@ namespace nise {
                 if (lshkit::min(im.height(), im.width()) < int(MIN_IMAGE_SIZE)) return;
             }
 
-            std::vector<Sift::Feature> sift;
-            CImg<float> gray;
-
+            sift.clear();
             CImgToGray(im, &gray);
 
             float scale = CImgLimitSize(&gray, MAX_IMAGE_SIZE);
@@ -49,7 +89,10 @@ namespace nise {
                 scale *= CImgLimitSizeBelow(&gray, QUERY_IMAGE_SCALE_THRESHOLD);
             }
 
-            xtor.extract(gray, scale, &sift);
+            {
+                StageTimer stage(metrics.sift);
+                xtor.extract(gray, scale, &sift);
+            }
 
             record->meta.width = im.width();
             record->meta.height = im.height();
@@ -64,9 +107,12 @@ namespace nise {
 
             record->regions.resize(sift.size());
             record->features.resize(sift.size());
-            for (unsigned i = 0; i < sift.size(); ++i) {
-                record->regions[i] = sift[i].region;
-                sketch.apply(&sift[i].desc[0], record->features[i].sketch);
+            {
+                StageTimer stage(metrics.sketch);
+                for (unsigned i = 0; i < sift.size(); ++i) {
+                    record->regions[i] = sift[i].region;
+                    sketch.apply(&sift[i].desc[0], record->features[i].sketch);
+                }
             }
 
             CImgLimitSize(&im, THUMBNAIL_SIZE);
@@ -88,5 +134,28 @@ namespace nise {
     Extractor::~Extractor () {
         delete impl;
     }
+
+    Extractor &Extractor::local () {
+        static thread_local Extractor xtor;
+        return xtor;
+    }
+
+    bool Extractor::checkProjection (const std::string &path) {
+        std::string mine;
+        Fingerprint(&mine);
+        {
+            std::ifstream is(path.c_str(), std::ios::binary);
+            if (is) {
+                std::string saved;
+                Signature::PROJECTION.check(is);
+                ReadString(is, &saved);
+                return is && (saved == mine);
+            }
+        }
+        std::ofstream os(path.c_str(), std::ios::binary);
+        Signature::PROJECTION.write(os);
+        WriteString(os, mine);
+        return bool(os);
+    }
 }
 
@@ -7,12 +7,24 @@ namespace nise {
 
     struct ExtractorImpl;
 
+    // The LSH projection of the sketches is generated once per process
+    // and shared by all extractors; an extractor only holds the SIFT
+    // state and buffers, which are reused across images.
     class Extractor {
         ExtractorImpl *impl;
     public:
         Extractor ();
         void extract (const std::string &image, Record *record, bool query = true);
         ~Extractor ();
+
+        // The extractor of the calling thread.
+        static Extractor &local ();
+
+        // Compares the projection with the one saved at path, or saves it
+        // there if the file does not exist, so that sketches computed
+        // offline and online can be checked to be identical.  False on a
+        // mismatch or an unreadable file.
+        static bool checkProjection (const std::string &path);
     };
 }
 
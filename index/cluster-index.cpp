@@ -0,0 +1,94 @@
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <boost/assert.hpp>
+#include <boost/foreach.hpp>
+#include <boost/program_options.hpp>
+#include "../common/nise.h"
+
+namespace po = boost::program_options;
+
+// Converts the clusters found by cluster into the dense map the server
+// collapses results with, see server/cluster.h.  Clusters of one image
+// are dropped.
+int main (int argc, char *argv[]) {
+    std::string input;
+    std::string mapping;
+    std::string output;
+
+    po::options_description desc("Allowed options");
+    desc.add_options()
+    ("help,h", "produce help message.")
+    ("input", po::value(&input), "clusters, as written by cluster")
+    ("map", po::value(&mapping), "optional id mapping, e.g. from cluster2id")
+    ("output", po::value(&output), "cluster map, see server/cluster.h")
+    ;
+
+    po::positional_options_description p;
+    p.add("input", 1).add("output", 1);
+
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).
+                     options(desc).positional(p).run(), vm);
+    po::notify(vm);
+
+    if (vm.count("help") || (vm.count("input") == 0) || (vm.count("output") == 0)) {
+        std::cerr << desc;
+        return 1;
+    }
+
+    std::vector<nise::ImageID> map;
+
+    if (vm.count("map")) {
+        std::ifstream is(mapping.c_str(), std::ios::binary);
+        nise::ReadVector<nise::ImageID>(is, &map);
+    }
+
+    std::vector<uint32_t> cluster;
+    std::vector<uint64_t> offset(1, 0);
+    std::vector<nise::ImageID> members;
+    {
+        std::ifstream is(input.c_str(), std::ios::binary);
+        for (;;) {
+            std::vector<nise::ImageID> gr;
+            nise::ReadVector<nise::ImageID>(is, &gr);
+            if (!is) break;
+            if (gr.size() < 2) continue;
+            uint32_t c = offset.size() - 1;
+            BOOST_FOREACH(nise::ImageID v, gr) {
+                if (map.size()) {
+                    BOOST_VERIFY(v < map.size());   // the mapping covers every image
+                    v = map[v];
+                }
+                if (v >= cluster.size()) cluster.resize(v + 1, uint32_t(-1));
+                BOOST_VERIFY(cluster[v] == uint32_t(-1));   // clusters are disjoint
+                cluster[v] = c;
+                members.push_back(v);
+            }
+            offset.push_back(members.size());
+        }
+    }
+    // keep the offsets aligned
+    if (cluster.size() % 2) cluster.push_back(uint32_t(-1));
+
+    std::ofstream os(output.c_str(), std::ios::binary);
+    nise::Signature::CLUSTER.write(os);
+    nise::WriteUint32(os, cluster.size());
+    nise::WriteUint32(os, offset.size() - 1);
+    nise::WriteUint32(os, 0);
+    nise::WriteUint64(os, members.size());
+    if (cluster.size()) {
+        os.write(reinterpret_cast<const char *>(&cluster[0]), cluster.size() * sizeof(cluster[0]));
+    }
+    os.write(reinterpret_cast<const char *>(&offset[0]), offset.size() * sizeof(offset[0]));
+    if (members.size()) {
+        os.write(reinterpret_cast<const char *>(&members[0]), members.size() * sizeof(members[0]));
+    }
+    BOOST_VERIFY(os);
+
+    std::cerr << offset.size() - 1 << " clusters of " << members.size() << " images." << std::endl;
+
+    return 0;
+}
+
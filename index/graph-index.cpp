@@ -25,9 +25,9 @@ int main (int argc, char *argv[]) {
     po::options_description desc("Allowed options");
     desc.add_options()
     ("help,h", "produce help message.")
-    ("input", po::value(&input), "")
-    ("map", po::value(&mapping), "")
-    ("output", po::value(&output), "")
+    ("input", po::value(&input), "adjacency lists: id, neighbors")
+    ("map", po::value(&mapping), "optional id mapping")
+    ("output", po::value(&output), "CSR graph, see server/expand.h")
     ;
 
     po::positional_options_description p;
@@ -38,34 +38,80 @@ int main (int argc, char *argv[]) {
                      options(desc).positional(p).run(), vm);
     po::notify(vm); 
 
-    if (vm.count("help") || (vm.count("input") == 0) || (vm.count("output") == 0) || (vm.count("map") == 0)) {
+    if (vm.count("help") || (vm.count("input") == 0) || (vm.count("output") == 0)) {
         std::cerr << desc;
         return 1;
     }
 
     std::vector<nise::ImageID> map;
 
-    {
+    if (vm.count("map")) {
         std::ifstream is(mapping.c_str(), std::ios::binary);
         nise::ReadVector<nise::ImageID>(is, &map);
     }
 
-    // loading, write whole containers
-    std::ifstream is(input.c_str(), std::ios::binary);
+    // pass 1: degrees
+    std::vector<uint64_t> offset(1, 0);
+    uint64_t edges = 0;
+    {
+        std::ifstream is(input.c_str(), std::ios::binary);
+        for (;;) {
+            nise::ImageID id;
+            std::vector<nise::ImageID> gr;
+            id = nise::ReadUint32(is);
+            nise::ReadVector<nise::ImageID>(is, &gr);
+            if (!is) break;
+            if (map.size()) id = map[id];
+            if (id + 2 > offset.size()) offset.resize(id + 2, 0);
+            offset[id + 1] += gr.size();
+            edges += gr.size();
+        }
+    }
+
+    uint32_t n = offset.size() - 1;
+    uint32_t count = 0;
+    for (unsigned i = 0; i < n; ++i) {
+        if (offset[i + 1]) ++count;
+        offset[i + 1] += offset[i];
+    }
+    BOOST_VERIFY(offset[n] == edges);
+
     std::ofstream os(output.c_str(), std::ios::binary);
-    for (;;) {
-        nise::ImageID id;
-        std::vector<nise::ImageID> gr;
-        id = nise::ReadUint32(is);
-        nise::ReadVector<nise::ImageID>(is, &gr);
-        if (!is) break;
-        nise::WriteUint32(os, map[id]);
-        BOOST_FOREACH(auto &v, gr) {
-            v = map[v];
+    nise::Signature::GRAPH.write(os);
+    nise::WriteUint32(os, n);
+    nise::WriteUint32(os, count);
+    nise::WriteUint32(os, 0);
+    nise::WriteUint64(os, edges);
+    os.write(reinterpret_cast<const char *>(&offset[0]), offset.size() * sizeof(offset[0]));
+    std::streamoff base = os.tellp();
+    BOOST_VERIFY(base == std::streamoff(6 * sizeof(uint32_t) + offset.size() * sizeof(offset[0])));
+
+    // pass 2: neighbors, written in place
+    {
+        std::vector<uint64_t> fill(offset.begin(), offset.end() - 1);
+        std::ifstream is(input.c_str(), std::ios::binary);
+        boost::progress_display progress(edges, std::cerr);
+        for (;;) {
+            nise::ImageID id;
+            std::vector<nise::ImageID> gr;
+            id = nise::ReadUint32(is);
+            nise::ReadVector<nise::ImageID>(is, &gr);
+            if (!is) break;
+            if (map.size()) {
+                id = map[id];
+                BOOST_FOREACH(auto &v, gr) {
+                    v = map[v];
+                }
+            }
+            if (gr.empty()) continue;
+            os.seekp(base + std::streamoff(fill[id] * sizeof(nise::ImageID)));
+            os.write(reinterpret_cast<const char *>(&gr[0]), gr.size() * sizeof(gr[0]));
+            fill[id] += gr.size();
+            progress += gr.size();
         }
-        nise::WriteVector<nise::ImageID>(os, gr);
     }
+    os.seekp(0, std::ios::end);
+    BOOST_VERIFY(os.tellp() == std::streamoff(base + edges * sizeof(nise::ImageID)));
 
     return 0;
 }
-
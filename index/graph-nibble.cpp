@@ -0,0 +1,113 @@
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <boost/assert.hpp>
+#include <boost/foreach.hpp>
+#include <boost/program_options.hpp>
+#include <boost/progress.hpp>
+#include <Poco/File.h>
+#include <omp.h>
+#include "../common/nise.h"
+#include "../server/expand.h"
+
+// Precomputes the expansion of every vertex with enough neighbors, i.e.
+// the result of Expansion::apply with the vertex as the only seed.  The
+// output is in the same CSR format as the graph, with the cluster of v
+// as the "neighbors" of v, and is used by the server as
+// nise.expansion.cache.
+//
+// This runs the server's Nibble, not GraphNibble of cluster.cpp: the
+// latter removes vertices as it partitions the graph, so it would not
+// reproduce what the server returns for a single seed.
+
+namespace po = boost::program_options; 
+
+int main (int argc, char *argv[]) {
+    std::string input;
+    std::string output;
+    unsigned min_degree;
+    unsigned block;
+
+    po::options_description desc("Allowed options");
+    desc.add_options()
+    ("help,h", "produce help message.")
+    ("min-degree", po::value(&min_degree)->default_value(nise::NIBBLE_CACHE_MIN_DEGREE), "only vertices with at least this many neighbors")
+    ("block", po::value(&block)->default_value(65536), "vertices processed in parallel before writing")
+    ("input", po::value(&input), "CSR graph")
+    ("output", po::value(&output), "CSR expansion cache")
+    ;
+
+    po::positional_options_description p;
+    p.add("input", 1).add("output", 1);
+
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).
+                     options(desc).positional(p).run(), vm);
+    po::notify(vm); 
+
+    if (vm.count("help") || (vm.count("input") == 0) || (vm.count("output") == 0)) {
+        std::cerr << desc;
+        return 1;
+    }
+
+    nise::Graph graph(input);
+
+    std::vector<nise::ImageID> todo;
+    for (nise::ImageID v = 0; v < graph.slots(); ++v) {
+        if (graph.degree(v) >= min_degree) todo.push_back(v);
+    }
+
+    uint32_t n = graph.slots();
+    uint32_t count = todo.size();
+    std::vector<uint64_t> offset(size_t(n) + 1, 0);
+
+    // offsets are only known at the end, the header is rewritten then
+    std::ofstream os(output.c_str(), std::ios::binary);
+    nise::Signature::GRAPH.write(os);
+    nise::WriteUint32(os, n);
+    nise::WriteUint32(os, count);
+    nise::WriteUint32(os, 0);
+    nise::WriteUint64(os, 0);
+    os.write(reinterpret_cast<const char *>(&offset[0]), offset.size() * sizeof(offset[0]));
+    BOOST_VERIFY(os.tellp() == std::streamoff(nise::Graph::HEADER_SIZE + offset.size() * sizeof(offset[0])));
+
+    boost::progress_display progress(todo.size(), std::cerr);
+    std::vector<std::vector<nise::ImageID> > results(block);
+    uint64_t edges = 0;
+    for (size_t begin = 0; begin < todo.size(); begin += block) {
+        size_t end = std::min(todo.size(), begin + block);
+#pragma omp parallel
+        {
+            nise::Nibble::Scratch scratch;
+            nise::Nibble nibble(graph, nise::NIBBLE_ALPHA, nise::NIBBLE_EPSILON, nise::NIBBLE_MAXIT, &scratch);
+            std::vector<nise::ImageID> seed(1);
+#pragma omp for schedule(dynamic, 64)
+            for (long i = begin; i < long(end); ++i) {
+                seed[0] = todo[i];
+                nibble.nibble(seed, &results[i - begin]);
+            }
+        }
+        for (size_t i = begin; i < end; ++i) {
+            std::vector<nise::ImageID> &r = results[i - begin];
+            BOOST_VERIFY(r.size());
+            os.write(reinterpret_cast<const char *>(&r[0]), r.size() * sizeof(r[0]));
+            offset[todo[i] + 1] = r.size();
+            edges += r.size();
+            ++progress;
+        }
+    }
+
+    for (unsigned i = 0; i < n; ++i) {
+        offset[i + 1] += offset[i];
+    }
+    BOOST_VERIFY(offset[n] == edges);
+
+    os.seekp(4 * sizeof(uint32_t));
+    nise::WriteUint64(os, edges);
+    os.write(reinterpret_cast<const char *>(&offset[0]), offset.size() * sizeof(offset[0]));
+    os.seekp(0, std::ios::end);
+    BOOST_VERIFY(os.tellp() == std::streamoff(nise::Graph::HEADER_SIZE + offset.size() * sizeof(offset[0]) + edges * sizeof(nise::ImageID)));
+
+    return 0;
+}
@@ -45,6 +45,7 @@ int main (int argc, char *argv[]) {
     std::string input;
     std::string output;
     std::string log;
+    std::string projection;
     std::vector<std::string> conf;
 
     po::options_description desc("Allowed options");
@@ -54,6 +55,7 @@ int main (int argc, char *argv[]) {
     ("output,O", po::value(&output), "hadoop output")
     ("log,E", po::value(&log), "log file")
     ("local", "output is a local file")
+    ("projection", po::value(&projection), "check the LSH projection against this file, or save it there")
     ;
 
     po::positional_options_description p;
@@ -68,6 +70,11 @@ int main (int argc, char *argv[]) {
         return 1;
     }
 
+    if (!projection.empty() && !Extractor::checkProjection(projection)) {
+        std::cerr << "LSH projection differs from " << projection << std::endl;
+        return 1;
+    }
+
     std::ifstream in;
     if (!input.empty()) {
         in.open(input.c_str());
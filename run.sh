@@ -86,8 +86,10 @@ split -l $EXTRACT_BATCH $WORK_DIR/list $WORK_DIR/split
 
 hadoop fs -mkdir $HADOOP_WORK_DIR/import
 
+# saved once so that the import tasks and the server can check their sketches agree
+$NISE_HOME/bin/extract --projection $OUTPUT_DIR/projection < /dev/null
 T=`date +'%s'`
-ls $WORK_DIR/split* | parallel -j $EXTRACT_TASKS $NISE_HOME/bin/import --input {} --output $HADOOP_WORK_DIR/import/{/} 
+ls $WORK_DIR/split* | parallel -j $EXTRACT_TASKS $NISE_HOME/bin/import --projection $OUTPUT_DIR/projection --input {} --output $HADOOP_WORK_DIR/import/{/} 
 T2=`date +'%s'`
 echo import $((T2-T)) >> $WORK_DIR/log
 T=$T2
@@ -114,7 +116,9 @@ echo group-join $((T2-T)) >> $WORK_DIR/log
 
 $NISE_HOME/bin/download $HADOOP_WORK_DIR/group $OUTPUT_DIR/images
 $NISE_HOME/bin/group-index < $OUTPUT_DIR/images > $OUTPUT_DIR/images.idx
-$NISE_HOME/bin/download $HADOOP_WORK_DIR/graph-join $OUTPUT_DIR/graph
+$NISE_HOME/bin/download $HADOOP_WORK_DIR/graph-join $OUTPUT_DIR/graph.list
+$NISE_HOME/bin/graph-index $OUTPUT_DIR/graph.list $OUTPUT_DIR/graph
+$NISE_HOME/bin/graph-nibble $OUTPUT_DIR/graph $OUTPUT_DIR/graph.nibble
 
 for off in 0 32 64 96
 do
@@ -147,9 +151,11 @@ cat > $OUTPUT_DIR/server.xml <<FOO
     <nise>
         <sketch>
             <db>db</db>
+            <projection>projection</projection>
         </sketch>
         <expansion>
             <db>graph</db>
+            <cache>graph.nibble</cache>
         </expansion>
         <static>
             <root>$NISE_HOME/html</root>
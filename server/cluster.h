@@ -0,0 +1,95 @@
+#ifndef WDONG_NISE_CLUSTER
+#define WDONG_NISE_CLUSTER
+#include <boost/assert.hpp>
+#include <Poco/File.h>
+#include <Poco/SharedMemory.h>
+
+namespace nise {
+
+    // Clusters of near-identical images, as written by cluster-index:
+    //
+    //   Signature::CLUSTER
+    //   uint32 n         # image slots, i.e. max id + 1, rounded up to even
+    //   uint32 clusters
+    //   uint32 reserved
+    //   uint64 members
+    //   uint32 cluster[n]            # cluster of each image, NONE if alone
+    //   uint64 offset[clusters + 1]
+    //   ImageID member[members]
+    //
+    // The members of cluster c are member[offset[c] .. offset[c+1]).  The
+    // file is mmapped and used in place.
+    class ClusterMap {
+    public:
+        static const unsigned HEADER_SIZE = 6 * sizeof(uint32_t);
+        static const uint32_t NONE = uint32_t(-1);
+        typedef std::pair<const ImageID *, const ImageID *> Range;
+    private:
+        unsigned n;
+        unsigned count;
+        const uint32_t *cluster;
+        const uint64_t *offset;
+        const ImageID *member;
+        Poco::SharedPtr<Poco::SharedMemory> shared;
+
+    public:
+        ClusterMap (const std::string &path): n(0), count(0), cluster(0), offset(0), member(0) {
+            if (path.empty()) return;
+            shared = new Poco::SharedMemory(Poco::File(path), Poco::SharedMemory::AM_READ);
+            const char *begin = shared->begin();
+            size_t size = shared->end() - shared->begin();
+            BOOST_VERIFY(size >= HEADER_SIZE);
+            const uint32_t *header = reinterpret_cast<const uint32_t *>(begin);
+            BOOST_VERIFY(Signature::CLUSTER.check(header[0]));
+            n = header[1];
+            count = header[2];
+            uint64_t members = *reinterpret_cast<const uint64_t *>(header + 4);
+            BOOST_VERIFY(n % 2 == 0);
+            BOOST_VERIFY(size == HEADER_SIZE + n * sizeof(uint32_t)
+                    + (count + 1) * sizeof(uint64_t) + members * sizeof(ImageID));
+            cluster = reinterpret_cast<const uint32_t *>(begin + HEADER_SIZE);
+            offset = reinterpret_cast<const uint64_t *>(cluster + n);
+            member = reinterpret_cast<const ImageID *>(offset + count + 1);
+            BOOST_VERIFY(offset[count] == members);
+        }
+
+        bool empty () const {
+            return count == 0;
+        }
+
+        // # clusters
+        unsigned size () const {
+            return count;
+        }
+
+        uint32_t get (ImageID v) const {
+            if (v >= n) return NONE;
+            return cluster[v];
+        }
+
+        // the image that stands for the cluster of v, v if alone
+        ImageID canonical (ImageID v) const {
+            uint32_t c = get(v);
+            if (c >= count) return v;
+            return member[offset[c]];
+        }
+
+        // # images in cluster c
+        unsigned size (uint32_t c) const {
+            if (c >= count) return 1;
+            return unsigned(offset[c + 1] - offset[c]);
+        }
+
+        Range members (uint32_t c) const {
+            Range result;
+            result.first = result.second = member;
+            if (c >= count) return result;
+            result.first = member + offset[c];
+            result.second = member + offset[c + 1];
+            return result;
+        }
+    };
+}
+
+#endif
+
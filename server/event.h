@@ -0,0 +1,941 @@
+#ifndef WDONG_NISE_EVENT
+#define WDONG_NISE_EVENT
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <sstream>
+#include <fstream>
+#include <Poco/String.h>
+#include <Poco/Net/HTTPServerRequest.h>
+#include <Poco/Net/HTTPServerResponse.h>
+#include <Poco/Net/HTTPServerParams.h>
+#include <Poco/Net/SocketAddress.h>
+
+namespace nise {
+
+    // An epoll based HTTP/1.1 front end (nise.server.frontend = epoll).
+    // A few I/O threads accept connections, parse requests and write
+    // responses; the requests are handled on a TaskPool by the same
+    // handler as with the Poco server.  Connections are persistent unless
+    // the client asks otherwise, and pipelined requests (e.g. the
+    // thumbnails of a result page) are handled concurrently, with the
+    // responses sent back in order.  Request bodies may be chunked; they
+    // are read in full before the request is handled.  Responses are
+    // buffered in full and sent with a Content-Length, except those the
+    // handler sends chunked (e.g. /search/batch), which are streamed as
+    // they are written.  The bytes buffered over all connections are
+    // bounded by nise.server.buffer megabytes: beyond that no new
+    // requests are read, and uploads that do not fit are answered 503.
+    class EventServer {
+    public:
+        typedef void (*Handler) (Poco::Net::HTTPServerRequest &, Poco::Net::HTTPServerResponse &);
+
+    private:
+        class IOThread;
+
+        // a request and its response
+        struct Exchange {
+            std::string method, uri, version;
+            std::vector<std::pair<std::string, std::string> > headers;
+            std::string body;
+            bool keepAlive;
+            bool ready;             // output is complete
+            std::string output;     // status line, headers and body, not yet sent
+            Poco::Event drained;    // set when the output of the connection is sent
+        };
+        typedef Poco::SharedPtr<Exchange> ExchangePtr;
+
+        struct Connection {
+            int fd;
+            IOThread *io;
+            Poco::Net::SocketAddress peer;
+            // used by the I/O thread only
+            std::string in;         // received but not parsed
+            std::string out;        // being sent
+            size_t sent;
+            size_t charged;         // of in and out, to the server buffer
+            volatile size_t backlog;    // bytes of out not sent yet
+            bool closing;           // no more requests are read
+            bool continued;         // 100 Continue sent for the next request
+            unsigned events;        // registered with epoll
+            Poco::Timestamp active;
+            // protects pipeline, dead, and ready & output of the exchanges
+            Poco::FastMutex mutex;
+            std::deque<ExchangePtr> pipeline;   // in request order
+            bool dead;              // closed, responses are dropped
+        };
+        typedef Poco::SharedPtr<Connection> ConnectionPtr;
+
+        class Request: public Poco::Net::HTTPServerRequest {
+            std::istringstream body;
+            const Poco::Net::SocketAddress &client;
+            const EventServer &server;
+            Poco::Net::HTTPServerResponse &resp;
+        public:
+            Request (Exchange &ex, const Poco::Net::SocketAddress &client_,
+                     const EventServer &server_, Poco::Net::HTTPServerResponse &resp_)
+                : body(ex.body), client(client_), server(server_), resp(resp_) {
+                setMethod(ex.method);
+                setURI(ex.uri);
+                setVersion(ex.version);
+                for (unsigned i = 0; i < ex.headers.size(); ++i) {
+                    add(ex.headers[i].first, ex.headers[i].second);
+                }
+            }
+
+            std::istream &stream () {
+                return body;
+            }
+
+            bool expectContinue () const {
+                return false;   // the body has been read
+            }
+
+            const Poco::Net::SocketAddress &clientAddress () const {
+                return client;
+            }
+
+            const Poco::Net::SocketAddress &serverAddress () const {
+                return server.address;
+            }
+
+            const Poco::Net::HTTPServerParams &serverParams () const {
+                return *server.params;
+            }
+
+            Poco::Net::HTTPServerResponse &response () const {
+                return resp;
+            }
+
+            bool secure () const {
+                return false;
+            }
+        };
+
+        class Response: public Poco::Net::HTTPServerResponse {
+            // Collects the body of a streamed response into chunks.
+            class Chunks: public std::streambuf {
+                Response &owner;
+                std::string buf;
+            protected:
+                virtual int_type overflow (int_type c) {
+                    if (c != traits_type::eof()) {
+                        buf.push_back(char(c));
+                        if (buf.size() >= EVENT_CHUNK_SIZE) owner.emit(&buf, false);
+                    }
+                    return traits_type::not_eof(c);
+                }
+
+                virtual std::streamsize xsputn (const char *s, std::streamsize n) {
+                    buf.append(s, n);
+                    if (buf.size() >= EVENT_CHUNK_SIZE) owner.emit(&buf, false);
+                    return n;
+                }
+
+                virtual int sync () {
+                    owner.emit(&buf, false);
+                    return 0;
+                }
+            public:
+                Chunks (Response &o): owner(o) {
+                }
+
+                std::string &pending () {
+                    return buf;
+                }
+            };
+
+            EventServer &server;
+            ConnectionPtr conn;
+            ExchangePtr ex;
+            std::string body;
+            std::ostringstream stream;
+            Chunks chunks;
+            std::ostream chunked;
+            bool done;
+            bool streaming;         // the body is sent as it is written
+            bool started;           // the headers are sent
+            bool dropped;           // the connection is gone
+
+            // Sends data as a chunk, after the headers if not sent yet.
+            // Waits while the connection has EVENT_STREAM_WINDOW bytes to
+            // send.  The last call ends the body.
+            void emit (std::string *data, bool last) {
+                if (dropped) {
+                    data->clear();
+                    return;
+                }
+                if (data->empty() && !last) return;
+                std::string out;
+                if (!started) {
+                    setKeepAlive(ex->keepAlive);
+                    setDate(Poco::Timestamp());
+                    set("Server", server.name);
+                    std::ostringstream os(std::ios::binary);
+                    write(os);
+                    out = os.str();
+                    started = true;
+                }
+                if (!data->empty()) {
+                    std::ostringstream size;
+                    size << std::hex << data->size();
+                    out.append(size.str() + "\r\n");
+                    out.append(*data);
+                    out.append("\r\n", 2);
+                    data->clear();
+                }
+                if (last) out.append("0\r\n\r\n", 5);
+                if (!conn->io->complete(conn, ex, &out, last)) {
+                    dropped = true;
+                    return;
+                }
+                if (last) return;
+                for (;;) {
+                    {
+                        Poco::ScopedLock<Poco::FastMutex> lock(conn->mutex);
+                        if (conn->dead) {
+                            dropped = true;
+                            return;
+                        }
+                        if (ex->output.size() + conn->backlog < EVENT_STREAM_WINDOW) return;
+                    }
+                    ex->drained.tryWait(EVENT_POLL_INTERVAL);
+                }
+            }
+
+        public:
+            Response (EventServer &server_, const ConnectionPtr &conn_, const ExchangePtr &ex_)
+                : server(server_), conn(conn_), ex(ex_), stream(std::ios::binary), chunks(*this), chunked(&chunks),
+                done(false), streaming(false), started(false), dropped(false) {
+                setVersion(ex->version);
+            }
+
+            void sendContinue () {
+            }
+
+            // Chunked responses to HTTP/1.1 requests are streamed.
+            std::ostream &send () {
+                done = true;
+                if (getChunkedTransferEncoding() && (ex->version == "HTTP/1.1") && (ex->method != "HEAD")) {
+                    streaming = true;
+                    return chunked;
+                }
+                return stream;
+            }
+
+            void sendFile (const std::string &path, const std::string &mediaType) {
+                std::ifstream is(path.c_str(), std::ios::binary);
+                if (!is) throw Poco::FileNotFoundException(path);
+                body.assign(std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>());
+                setContentType(mediaType);
+                done = true;
+            }
+
+            void sendBuffer (const void *buffer, std::size_t length) {
+                body.assign(reinterpret_cast<const char *>(buffer), length);
+                done = true;
+            }
+
+            void redirect (const std::string &uri, HTTPStatus status = HTTP_FOUND) {
+                setStatusAndReason(status);
+                set("Location", uri);
+                done = true;
+            }
+
+            void requireAuthentication (const std::string &realm) {
+                setStatusAndReason(HTTP_UNAUTHORIZED);
+                set("WWW-Authenticate", "Basic realm=\"" + realm + "\"");
+                done = true;
+            }
+
+            bool sent () const {
+                return done;
+            }
+
+            // After the handler threw.  A streamed response that has
+            // started is just ended.
+            void fail () {
+                if (started) return;
+                streaming = false;
+                clear();
+                body.clear();
+                stream.str("");
+                chunks.pending().clear();
+                setStatusAndReason(HTTP_INTERNAL_SERVER_ERROR);
+            }
+
+            // Hands the rest of the response to the I/O thread.  A
+            // buffered response is sent with a Content-Length.
+            void finish () {
+                if (streaming) {
+                    emit(&chunks.pending(), true);
+                    return;
+                }
+                std::string data = stream.str();
+                if (data.empty()) data.swap(body);
+                else data.insert(0, body);
+                setChunkedTransferEncoding(false);
+                setContentLength(data.size());
+                setKeepAlive(ex->keepAlive);
+                setDate(Poco::Timestamp());
+                set("Server", server.name);
+                std::ostringstream os(std::ios::binary);
+                write(os);
+                std::string out = os.str();
+                if (ex->method != "HEAD") out.append(data);
+                conn->io->complete(conn, ex, &out, true);
+            }
+        };
+
+        class Task: public TaskPool::Task {
+            EventServer *server;
+            ConnectionPtr conn;
+            ExchangePtr ex;
+        public:
+            Task (EventServer *s, const ConnectionPtr &c, const ExchangePtr &e)
+                : server(s), conn(c), ex(e) {
+            }
+
+            void run () {
+                Response response(*server, conn, ex);
+                try {
+                    Request request(*ex, conn->peer, *server, response);
+                    server->handler(request, response);
+                }
+                catch (const std::exception &e) {
+                    Log::system().error(e.what());
+                    response.fail();
+                }
+                __sync_fetch_and_sub(&server->buffered, long(ex->body.size()));
+                std::string().swap(ex->body);
+                response.finish();
+            }
+        };
+
+        class IOThread: public Poco::Runnable {
+            EventServer &server;
+            int epfd;
+            int wake;               // eventfd, see complete
+            Poco::Thread thread;
+            Poco::FastMutex mutex;
+            std::vector<ConnectionPtr> finished;    // protected by mutex
+            std::map<int, ConnectionPtr> conns;
+            volatile bool stopping;
+
+            static void append (std::string *out, int status, const std::string &reason) {
+                std::string code = boost::lexical_cast<std::string>(status);
+                out->append("HTTP/1.1 " + code + ' ' + reason + "\r\n"
+                            "Content-Length: 0\r\nConnection: close\r\n\r\n");
+            }
+
+            void watch (Connection &conn, unsigned events) {
+                if (events == conn.events) return;
+                epoll_event ev;
+                std::memset(&ev, 0, sizeof(ev));
+                ev.events = events;
+                ev.data.fd = conn.fd;
+                epoll_ctl(epfd, EPOLL_CTL_MOD, conn.fd, &ev);
+                conn.events = events;
+            }
+
+            // Charges the bytes buffered by a connection to the server.
+            void charge (Connection &conn) {
+                size_t now = conn.in.size() + conn.out.size();
+                __sync_fetch_and_add(&server.buffered, long(now) - long(conn.charged));
+                conn.charged = now;
+            }
+
+            void update (Connection &conn) {
+                charge(conn);
+                unsigned events = 0;
+                // a request being received is read on even if the server
+                // buffer is full, see parse
+                if (!conn.closing && (!conn.in.empty() || !server.full())) {
+                    Poco::ScopedLock<Poco::FastMutex> lock(conn.mutex);
+                    // stop reading while the pipeline is full
+                    if (conn.pipeline.size() < server.pipeline) events |= EPOLLIN;
+                }
+                if (conn.sent < conn.out.size()) events |= EPOLLOUT;
+                watch(conn, events);
+            }
+
+            void close (const ConnectionPtr &conn) {
+                {
+                    Poco::ScopedLock<Poco::FastMutex> lock(conn->mutex);
+                    conn->dead = true;
+                    BOOST_FOREACH(const ExchangePtr &ex, conn->pipeline) {
+                        __sync_fetch_and_sub(&server.buffered, long(ex->output.size()));
+                        // a streaming handler waiting for the window
+                        ex->drained.set();
+                    }
+                    conn->pipeline.clear();
+                }
+                __sync_fetch_and_sub(&server.buffered, long(conn->charged));
+                conn->charged = 0;
+                epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, 0);
+                ::close(conn->fd);
+                conns.erase(conn->fd);
+                __sync_fetch_and_sub(&server.connections, 1);
+            }
+
+            // Answers a request that can not be handled and stops reading.
+            void reject (Connection &conn, int status, const std::string &reason) {
+                ExchangePtr ex = new Exchange;
+                ex->ready = true;
+                append(&ex->output, status, reason);
+                {
+                    Poco::ScopedLock<Poco::FastMutex> lock(conn.mutex);
+                    conn.pipeline.push_back(ex);
+                }
+                conn.closing = true;
+                conn.in.clear();
+            }
+
+            static const std::string *header (const Exchange &ex, const char *name) {
+                for (unsigned i = 0; i < ex.headers.size(); ++i) {
+                    if (Poco::icompare(ex.headers[i].first, name) == 0) return &ex.headers[i].second;
+                }
+                return 0;
+            }
+
+            // Decodes a chunked body starting at in[begin] into body, or
+            // only checks it if body is null.  Returns 1 and the end of the
+            // message in *end if it is complete, 0 if more is to come, -1 if
+            // it is malformed and -2 if the body is over EVENT_BODY_MAX.
+            // Extensions and trailers are dropped.
+            static int dechunk (const std::string &in, size_t begin, std::string *body, size_t *end) {
+                size_t p = begin;
+                size_t total = 0;
+                if (body) body->clear();
+                for (;;) {
+                    size_t eol = in.find("\r\n", p);
+                    if (eol == in.npos) return (in.size() - p > EVENT_HEADER_MAX) ? -1 : 0;
+                    size_t size = 0;
+                    size_t i = p;
+                    for (; i < eol; ++i) {
+                        char c = in[i];
+                        unsigned d;
+                        if ((c >= '0') && (c <= '9')) d = c - '0';
+                        else if ((c >= 'a') && (c <= 'f')) d = c - 'a' + 10;
+                        else if ((c >= 'A') && (c <= 'F')) d = c - 'A' + 10;
+                        else break;
+                        size = size * 16 + d;
+                        if (size > EVENT_BODY_MAX) return -2;
+                    }
+                    if ((i == p) || ((i < eol) && (in[i] != ';') && (in[i] != ' ') && (in[i] != '\t'))) return -1;
+                    p = eol + 2;
+                    if (size == 0) {
+                        // trailers, up to an empty line
+                        for (;;) {
+                            size_t e = in.find("\r\n", p);
+                            if (e == in.npos) return 0;
+                            bool empty = (e == p);
+                            p = e + 2;
+                            if (empty) break;
+                        }
+                        *end = p;
+                        return 1;
+                    }
+                    total += size;
+                    if (total > EVENT_BODY_MAX) return -2;
+                    if (in.size() < p + size + 2) return 0;
+                    if (in.compare(p + size, 2, "\r\n") != 0) return -1;
+                    if (body) body->append(in, p, size);
+                    p += size + 2;
+                }
+            }
+
+            static std::string trim (const std::string &s, size_t begin, size_t end) {
+                while ((begin < end) && ((s[begin] == ' ') || (s[begin] == '\t'))) ++begin;
+                while ((end > begin) && ((s[end - 1] == ' ') || (s[end - 1] == '\t'))) --end;
+                return s.substr(begin, end - begin);
+            }
+
+            // Parses the complete requests received and submits them.
+            void parse (const ConnectionPtr &conn) {
+                while (!conn->closing) {
+                    {
+                        Poco::ScopedLock<Poco::FastMutex> lock(conn->mutex);
+                        if (conn->pipeline.size() >= server.pipeline) break;
+                    }
+                    std::string &in = conn->in;
+                    size_t head = in.find("\r\n\r\n");
+                    if (head == in.npos) {
+                        if (in.size() > EVENT_HEADER_MAX) reject(*conn, 431, "Request Header Fields Too Large");
+                        break;
+                    }
+                    ExchangePtr ex = new Exchange;
+                    size_t eol = in.find("\r\n");
+                    {
+                        std::string line = in.substr(0, eol);
+                        size_t s1 = line.find(' ');
+                        size_t s2 = (s1 == line.npos) ? line.npos : line.find(' ', s1 + 1);
+                        if (s2 == line.npos) {
+                            reject(*conn, 400, "Bad Request");
+                            break;
+                        }
+                        ex->method = line.substr(0, s1);
+                        ex->uri = line.substr(s1 + 1, s2 - s1 - 1);
+                        ex->version = line.substr(s2 + 1);
+                    }
+                    if ((ex->version != "HTTP/1.1") && (ex->version != "HTTP/1.0")) {
+                        reject(*conn, 505, "HTTP Version Not Supported");
+                        break;
+                    }
+                    for (size_t p = eol + 2; p < head + 2; ) {
+                        size_t e = in.find("\r\n", p);
+                        size_t colon = in.find(':', p);
+                        if ((colon != in.npos) && (colon < e)) {
+                            ex->headers.push_back(std::make_pair(trim(in, p, colon), trim(in, colon + 1, e)));
+                        }
+                        p = e + 2;
+                    }
+                    const std::string *te = header(*ex, "Transfer-Encoding");
+                    bool chunked = false;
+                    if (te && (Poco::icompare(*te, "identity") != 0)) {
+                        if (Poco::icompare(*te, "chunked") != 0) {
+                            reject(*conn, 501, "Not Implemented");
+                            break;
+                        }
+                        chunked = true;
+                    }
+                    size_t length = 0;
+                    size_t end = 0;     // of the request in in
+                    int state;
+                    if (chunked) {
+                        state = dechunk(in, head + 4, 0, &end);
+                    }
+                    else {
+                        const std::string *cl = header(*ex, "Content-Length");
+                        if (cl) {
+                            try {
+                                length = boost::lexical_cast<size_t>(*cl);
+                            }
+                            catch (const boost::bad_lexical_cast &) {
+                                reject(*conn, 400, "Bad Request");
+                                break;
+                            }
+                        }
+                        state = (length > EVENT_BODY_MAX) ? -2 : ((in.size() < head + 4 + length) ? 0 : 1);
+                        end = head + 4 + length;
+                    }
+                    if (state == -1) {
+                        reject(*conn, 400, "Bad Request");
+                        break;
+                    }
+                    if (state == -2) {
+                        reject(*conn, 413, "Request Entity Too Large");
+                        break;
+                    }
+                    if (state == 0) {
+                        // the rest of the body must fit in the server buffer
+                        if (server.full(chunked ? 0 : end - in.size())) {
+                            reject(*conn, 503, "Service Unavailable");
+                            break;
+                        }
+                        const std::string *expect = header(*ex, "Expect");
+                        if (expect && !conn->continued && (Poco::icompare(*expect, "100-continue") == 0)
+                                && (conn->out.size() == conn->sent)) {
+                            bool idle;
+                            {
+                                Poco::ScopedLock<Poco::FastMutex> lock(conn->mutex);
+                                idle = conn->pipeline.empty();
+                            }
+                            if (idle) {
+                                conn->out = "HTTP/1.1 100 Continue\r\n\r\n";
+                                conn->sent = 0;
+                                conn->continued = true;
+                            }
+                        }
+                        break;
+                    }
+                    if (chunked) {
+                        dechunk(in, head + 4, &ex->body, &end);
+                        // the handler sees a plain body
+                        for (unsigned i = 0; i < ex->headers.size(); ) {
+                            if (Poco::icompare(ex->headers[i].first, "Transfer-Encoding") == 0) {
+                                ex->headers.erase(ex->headers.begin() + i);
+                            }
+                            else ++i;
+                        }
+                        ex->headers.push_back(std::make_pair(std::string("Content-Length"),
+                                    boost::lexical_cast<std::string>(ex->body.size())));
+                    }
+                    else {
+                        ex->body = in.substr(head + 4, length);
+                    }
+                    in.erase(0, end);
+                    // released by the task
+                    __sync_fetch_and_add(&server.buffered, long(ex->body.size()));
+                    conn->continued = false;
+                    const std::string *connection = header(*ex, "Connection");
+                    if (ex->version == "HTTP/1.1") {
+                        ex->keepAlive = !(connection && (Poco::icompare(*connection, "close") == 0));
+                    }
+                    else {
+                        ex->keepAlive = connection && (Poco::icompare(*connection, "keep-alive") == 0);
+                    }
+                    ex->keepAlive = ex->keepAlive && server.keepAlive;
+                    if (!ex->keepAlive) conn->closing = true;
+                    ex->ready = false;
+                    {
+                        Poco::ScopedLock<Poco::FastMutex> lock(conn->mutex);
+                        conn->pipeline.push_back(ex);
+                    }
+                    server.pool->submit(new Task(&server, conn, ex));
+                }
+            }
+
+            // Sends the responses, in order: those that are ready, and
+            // what has been streamed of the first one that is not.
+            void flush (const ConnectionPtr &conn) {
+                bool idle;
+                {
+                    Poco::ScopedLock<Poco::FastMutex> lock(conn->mutex);
+                    if (conn->dead) return;
+                    size_t moved = 0;
+                    while (!conn->pipeline.empty()) {
+                        Exchange &ex = *conn->pipeline.front();
+                        moved += ex.output.size();
+                        conn->out.append(ex.output);
+                        ex.output.clear();
+                        if (!ex.ready) break;
+                        conn->pipeline.pop_front();
+                    }
+                    // now charged with out
+                    __sync_fetch_and_sub(&server.buffered, long(moved));
+                    idle = conn->pipeline.empty();
+                }
+                while (conn->sent < conn->out.size()) {
+                    ssize_t w = ::send(conn->fd, conn->out.data() + conn->sent,
+                                       conn->out.size() - conn->sent, MSG_NOSIGNAL);
+                    if (w > 0) {
+                        conn->sent += w;
+                        conn->active.update();
+                    }
+                    else if ((w < 0) && (errno == EINTR)) continue;
+                    else if ((w < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) break;
+                    else {
+                        close(conn);
+                        return;
+                    }
+                }
+                if (conn->sent == conn->out.size()) {
+                    conn->out.clear();
+                    conn->sent = 0;
+                    if (conn->out.capacity() > RESPONSE_BUFFER_KEEP) {
+                        std::string().swap(conn->out);
+                    }
+                    if (conn->closing && idle) {
+                        close(conn);
+                        return;
+                    }
+                }
+                conn->backlog = conn->out.size() - conn->sent;
+                if (!idle) {
+                    // a streaming response might wait for the window
+                    Poco::ScopedLock<Poco::FastMutex> lock(conn->mutex);
+                    if (!conn->pipeline.empty()) conn->pipeline.front()->drained.set();
+                }
+                // room in the pipeline again
+                parse(conn);
+                update(*conn);
+            }
+
+            void receive (const ConnectionPtr &conn) {
+                char buf[UPLOAD_BUFFER_SIZE];
+                for (;;) {
+                    ssize_t r = ::recv(conn->fd, buf, sizeof(buf), 0);
+                    if (r > 0) {
+                        conn->in.append(buf, r);
+                        conn->active.update();
+                        charge(*conn);
+                        if (conn->in.size() > EVENT_HEADER_MAX + EVENT_BODY_MAX) break;
+                    }
+                    else if (r == 0) {
+                        // half closed, answer what has been received
+                        parse(conn);
+                        conn->closing = true;
+                        break;
+                    }
+                    else if (errno == EINTR) continue;
+                    else if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) break;
+                    else {
+                        close(conn);
+                        return;
+                    }
+                }
+                parse(conn);
+                flush(conn);
+            }
+
+            void accept () {
+                for (;;) {
+                    sockaddr_storage addr;
+                    socklen_t len = sizeof(addr);
+                    int fd = ::accept4(server.listener, reinterpret_cast<sockaddr *>(&addr), &len,
+                                       SOCK_NONBLOCK | SOCK_CLOEXEC);
+                    if (fd < 0) {
+                        if (errno == EINTR) continue;
+                        if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+                            Log::system().warning(std::string("accept: ") + std::strerror(errno));
+                        }
+                        return;
+                    }
+                    if (__sync_add_and_fetch(&server.connections, 1) > server.maxConnections) {
+                        __sync_fetch_and_sub(&server.connections, 1);
+                        ::close(fd);
+                        continue;
+                    }
+                    int one = 1;
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                    ConnectionPtr conn = new Connection;
+                    conn->fd = fd;
+                    conn->io = this;
+                    conn->peer = Poco::Net::SocketAddress(reinterpret_cast<sockaddr *>(&addr), len);
+                    conn->sent = 0;
+                    conn->charged = 0;
+                    conn->backlog = 0;
+                    conn->closing = false;
+                    conn->continued = false;
+                    conn->events = EPOLLIN;
+                    conn->dead = false;
+                    epoll_event ev;
+                    std::memset(&ev, 0, sizeof(ev));
+                    ev.events = EPOLLIN;
+                    ev.data.fd = fd;
+                    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+                    conns[fd] = conn;
+                }
+            }
+
+            // Closes the connections idle for too long, and resumes
+            // reading those stopped while the server buffer was full.
+            void sweep () {
+                std::vector<ConnectionPtr> idle;
+                for (std::map<int, ConnectionPtr>::iterator it = conns.begin(); it != conns.end(); ++it) {
+                    Connection &conn = *it->second;
+                    update(conn);
+                    if (conn.out.size() || !conn.active.isElapsed(server.idle)) continue;
+                    Poco::ScopedLock<Poco::FastMutex> lock(conn.mutex);
+                    if (conn.pipeline.empty()) idle.push_back(it->second);
+                }
+                BOOST_FOREACH(const ConnectionPtr &conn, idle) {
+                    close(conn);
+                }
+            }
+
+        public:
+            IOThread (EventServer &s): server(s), stopping(false) {
+                epfd = epoll_create1(EPOLL_CLOEXEC);
+                BOOST_VERIFY(epfd >= 0);
+                wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+                BOOST_VERIFY(wake >= 0);
+                epoll_event ev;
+                std::memset(&ev, 0, sizeof(ev));
+                ev.events = EPOLLIN;
+                ev.data.fd = wake;
+                BOOST_VERIFY(epoll_ctl(epfd, EPOLL_CTL_ADD, wake, &ev) == 0);
+                // every I/O thread accepts
+                ev.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+                ev.events |= EPOLLEXCLUSIVE;
+#endif
+                ev.data.fd = server.listener;
+                BOOST_VERIFY(epoll_ctl(epfd, EPOLL_CTL_ADD, server.listener, &ev) == 0);
+            }
+
+            ~IOThread () {
+                ::close(wake);
+                ::close(epfd);
+            }
+
+            void start () {
+                thread.start(*this);
+            }
+
+            void stop () {
+                stopping = true;
+                uint64_t one = 1;
+                ssize_t r = ::write(wake, &one, sizeof(one));
+                (void)r;
+                thread.join();
+            }
+
+            // Called by the handler threads with more output of ex, the
+            // last time with last set.  False if the connection is closed.
+            bool complete (const ConnectionPtr &conn, const ExchangePtr &ex, std::string *output, bool last) {
+                {
+                    Poco::ScopedLock<Poco::FastMutex> lock(conn->mutex);
+                    if (conn->dead) return false;
+                    // released by flush
+                    __sync_fetch_and_add(&server.buffered, long(output->size()));
+                    if (ex->output.empty()) ex->output.swap(*output);
+                    else ex->output.append(*output);
+                    if (last) ex->ready = true;
+                }
+                {
+                    Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+                    finished.push_back(conn);
+                }
+                uint64_t one = 1;
+                ssize_t r = ::write(wake, &one, sizeof(one));
+                (void)r;
+                return true;
+            }
+
+            void run () {
+                epoll_event events[EVENT_BATCH];
+                Poco::Timestamp swept;
+                while (!stopping) {
+                    int n = epoll_wait(epfd, events, EVENT_BATCH, EVENT_POLL_INTERVAL);
+                    for (int i = 0; i < n; ++i) {
+                        int fd = events[i].data.fd;
+                        if (fd == server.listener) {
+                            accept();
+                        }
+                        else if (fd == wake) {
+                            uint64_t v;
+                            ssize_t r = ::read(wake, &v, sizeof(v));
+                            (void)r;
+                            std::vector<ConnectionPtr> ready;
+                            {
+                                Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+                                ready.swap(finished);
+                            }
+                            BOOST_FOREACH(const ConnectionPtr &conn, ready) {
+                                flush(conn);
+                            }
+                        }
+                        else {
+                            std::map<int, ConnectionPtr>::iterator it = conns.find(fd);
+                            if (it == conns.end()) continue;
+                            ConnectionPtr conn = it->second;
+                            if (events[i].events & EPOLLIN) {
+                                receive(conn);
+                            }
+                            else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                                close(conn);
+                                continue;
+                            }
+                            if (events[i].events & EPOLLOUT) {
+                                flush(conn);
+                            }
+                        }
+                    }
+                    if (swept.isElapsed(Poco::Timestamp::TimeDiff(EVENT_POLL_INTERVAL) * 1000)) {
+                        sweep();
+                        swept.update();
+                    }
+                }
+                std::vector<ConnectionPtr> all;
+                for (std::map<int, ConnectionPtr>::iterator it = conns.begin(); it != conns.end(); ++it) {
+                    all.push_back(it->second);
+                }
+                BOOST_FOREACH(const ConnectionPtr &conn, all) {
+                    close(conn);
+                }
+            }
+        };
+
+        Handler handler;
+        std::string name;
+        Poco::Net::SocketAddress address;
+        Poco::Net::HTTPServerParams::Ptr params;
+        int listener;
+        unsigned pipeline;          // max requests in flight per connection
+        Poco::Timestamp::TimeDiff idle;
+        bool keepAlive;
+        int connections;
+        int maxConnections;
+        long buffered;              // bytes of requests and responses in memory
+        long budget;                // 0 for no limit
+        TaskPool *pool;
+        std::vector<IOThread *> threads;
+
+    public:
+        EventServer (Handler handler_, const Poco::Util::AbstractConfiguration &config,
+                     const Poco::Net::HTTPServerParams::Ptr &params_)
+            : handler(handler_), params(params_), connections(0), buffered(0), pool(0) {
+            unsigned short port = config.getInt("nise.server.port", 80);
+            name = config.getString("nise.server.name", "nise");
+            address = Poco::Net::SocketAddress("0.0.0.0", port);
+            pipeline = config.getInt("nise.server.pipeline", EVENT_PIPELINE_DEFAULT);
+            if (pipeline == 0) pipeline = 1;
+            idle = Poco::Timestamp::TimeDiff(config.getInt("nise.server.idle", EVENT_IDLE_DEFAULT)) * 1000;
+            keepAlive = config.getBool("nise.server.keepalive", true);
+            maxConnections = config.getInt("nise.server.connections", EVENT_CONNECTIONS_DEFAULT);
+            budget = long(config.getInt("nise.server.buffer", EVENT_BUFFER_DEFAULT)) << 20;
+
+            listener = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (listener < 0) throw Poco::IOException(std::string("socket: ") + std::strerror(errno));
+            int one = 1;
+            setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            sockaddr_in sin;
+            std::memset(&sin, 0, sizeof(sin));
+            sin.sin_family = AF_INET;
+            sin.sin_addr.s_addr = htonl(INADDR_ANY);
+            sin.sin_port = htons(port);
+            if ((::bind(listener, reinterpret_cast<sockaddr *>(&sin), sizeof(sin)) != 0)
+                    || (::listen(listener, SOMAXCONN) != 0)) {
+                std::string err = std::strerror(errno);
+                ::close(listener);
+                throw Poco::IOException("cannot listen on port " + boost::lexical_cast<std::string>(port) + ": " + err);
+            }
+
+            pool = new TaskPool(params->getMaxThreads());
+            threads.resize(config.getInt("nise.server.io_threads", EVENT_IO_THREADS_DEFAULT));
+            if (threads.empty()) threads.resize(1);
+            BOOST_FOREACH(IOThread *&t, threads) {
+                t = new IOThread(*this);
+            }
+        }
+
+        ~EventServer () {
+            BOOST_FOREACH(IOThread *t, threads) {
+                delete t;
+            }
+            ::close(listener);
+        }
+
+        void start () {
+            BOOST_FOREACH(IOThread *t, threads) {
+                t->start();
+            }
+        }
+
+        // The I/O threads close all connections, then the requests being
+        // handled are finished and dropped.
+        void stop () {
+            BOOST_FOREACH(IOThread *t, threads) {
+                t->stop();
+            }
+            delete pool;
+            pool = 0;
+        }
+
+        unsigned getConnections () const {
+            return connections;
+        }
+
+        // whether more bytes would exceed the buffer budget
+        bool full (size_t more = 0) const {
+            return budget && (buffered + long(more) > budget);
+        }
+
+        long getBuffered () const {
+            return buffered;
+        }
+    };
+}
+
+#endif
+
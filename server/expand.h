@@ -1,138 +1,326 @@
 #ifndef WDONG_NISE_EXPAND
 #define WDONG_NISE_EXPAND
-#include <set>
 #include <fstream>
 #include <algorithm>
-#include <map>
 #include <vector>
 #include <cmath>
 #include <limits>
 #include <boost/assert.hpp>
 #include <boost/foreach.hpp>
 #include <Poco/SharedMemory.h>
+#include <Poco/SharedPtr.h>
 
 namespace nise {
 
+    // The expansion graph in CSR form, as written by graph-index:
+    //
+    //   Signature::GRAPH
+    //   uint32 n         # vertex slots, i.e. max id + 1
+    //   uint32 size      # vertices with neighbors
+    //   uint32 reserved
+    //   uint64 edges
+    //   uint64 offset[n + 1]
+    //   ImageID neighbor[edges]
+    //
+    // The neighbors of v are neighbor[offset[v] .. offset[v+1]).  The file
+    // is mmapped and used in place.  A graph in the old adjacency list
+    // format (id, degree, neighbors ...) is converted in memory on load.
     class Graph {
-        ImageID *data;
-        std::map<ImageID, unsigned> map;
+    public:
+        static const unsigned HEADER_SIZE = 6 * sizeof(uint32_t);
+    private:
+        unsigned n;
+        unsigned count;
+        const uint64_t *offset;
+        const ImageID *neighbor;
         Poco::SharedPtr<Poco::SharedMemory> shared;
+        // only used for graphs in the old format
+        std::vector<uint64_t> offset_data;
+        std::vector<ImageID> neighbor_data;
+
+        void loadList (const ImageID *data, size_t size) {
+            size_t cur = 0;
+            ImageID max = 0;
+            while (cur + 1 < size) {
+                max = std::max(max, data[cur] + 1);
+                cur += data[cur + 1] + 2;
+            }
+            offset_data.resize(size_t(max) + 1);
+            std::fill(offset_data.begin(), offset_data.end(), 0);
+            cur = 0;
+            while (cur + 1 < size) {
+                offset_data[data[cur] + 1] += data[cur + 1];
+                cur += data[cur + 1] + 2;
+            }
+            for (unsigned i = 0; i < max; ++i) {
+                if (offset_data[i + 1]) ++count;
+                offset_data[i + 1] += offset_data[i];
+            }
+            neighbor_data.resize(offset_data.back());
+            std::vector<uint64_t> fill(offset_data.begin(), offset_data.end() - 1);
+            cur = 0;
+            while (cur + 1 < size) {
+                ImageID id = data[cur];
+                unsigned len = data[cur + 1];
+                std::copy(data + cur + 2, data + cur + 2 + len, neighbor_data.begin() + fill[id]);
+                fill[id] += len;
+                cur += len + 2;
+            }
+            n = max;
+            offset = &offset_data[0];
+            neighbor = neighbor_data.empty() ? 0 : &neighbor_data[0];
+            shared = 0;
+        }
+
     public:
         typedef std::pair<const ImageID *, const ImageID *> Range;
 
-        Graph (const std::string &path)
+        Graph (const std::string &path): n(0), count(0), offset(0), neighbor(0)
         {
-            data = 0;
-            if (!path.empty()) {
-                shared = new Poco::SharedMemory(Poco::File(path), Poco::SharedMemory::AM_READ);
-                size_t size = shared->end() - shared->begin();
-                BOOST_VERIFY(size % sizeof(data[0]) == 0);
-                size /= sizeof(data[0]);
-
-                data = reinterpret_cast<ImageID *>(shared->begin());
-
-                // count how many items are there
-                unsigned cur = 0;
-                while (cur < size) {
-                    ImageID id = data[cur];
-                    unsigned len_pos = cur + 1;
-                    unsigned len = data[len_pos];
-                    map[id] = len_pos;
-                    cur += len + 2;
-                }
+            if (path.empty()) return;
+            shared = new Poco::SharedMemory(Poco::File(path), Poco::SharedMemory::AM_READ);
+            const char *begin = shared->begin();
+            size_t size = shared->end() - shared->begin();
+            if ((size < HEADER_SIZE) || !Signature::GRAPH.check(*reinterpret_cast<const uint32_t *>(begin))) {
+                BOOST_VERIFY(size % sizeof(ImageID) == 0);
+                loadList(reinterpret_cast<const ImageID *>(begin), size / sizeof(ImageID));
+                return;
             }
+            const uint32_t *header = reinterpret_cast<const uint32_t *>(begin);
+            n = header[1];
+            count = header[2];
+            uint64_t edges = *reinterpret_cast<const uint64_t *>(header + 4);
+            BOOST_VERIFY(size == HEADER_SIZE + (n + 1) * sizeof(uint64_t) + edges * sizeof(ImageID));
+            offset = reinterpret_cast<const uint64_t *>(begin + HEADER_SIZE);
+            neighbor = reinterpret_cast<const ImageID *>(offset + n + 1);
+            BOOST_VERIFY(offset[n] == edges);
         }
 
+        // # vertices with neighbors
         unsigned size () const {
-            return map.size();
+            return count;
+        }
+
+        // # vertex slots, ids are below this
+        unsigned slots () const {
+            return n;
         }
 
         unsigned degree (ImageID v) const {
-            std::map<ImageID, unsigned>::const_iterator it
-                = map.find(v);
-            if (it == map.end()) return 0;
-            return data[it->second];
+            if (v >= n) return 0;
+            return unsigned(offset[v + 1] - offset[v]);
         }
 
-        Range get (ImageID id) const {
+        Range get (ImageID v) const {
             Range result;
-            result.first = result.second = &data[0];
-            std::map<ImageID, unsigned>::const_iterator it
-                = map.find(id);
-            if (it == map.end()) return result;
-            unsigned idx = it->second;
-            result.first = &data[idx+1];
-            result.second = result.first + data[idx];
+            result.first = result.second = neighbor;
+            if (v >= n) return result;
+            result.first = neighbor + offset[v];
+            result.second = neighbor + offset[v + 1];
             return result;
         }
     };
 
     class Nibble {
+    public:
+        // Reusable working memory of the nibble computation, so that a
+        // thread running many expansions stops allocating once warmed up.
+        // Vertices get dense slots through an open-addressing hash table
+        // that is cleared by bumping an epoch.
+        class Scratch {
+            friend class Nibble;
+
+            static const unsigned NONE = unsigned(-1);
+
+            struct Entry {
+                ImageID key;
+                unsigned epoch;
+                unsigned slot;
+            };
+
+            std::vector<Entry> table;
+            unsigned bits;
+            unsigned epoch;
+
+            // per slot
+            std::vector<ImageID> ids;
+            std::vector<unsigned> degree;
+            std::vector<float> p, r;
+            std::vector<char> queued;
+            std::vector<char> swept;
+
+            // FIFO of the slots with r(u)/d(u) >= epsilon
+            std::vector<unsigned> queue;
+            unsigned head;
+
+            std::vector<std::pair<float, unsigned> > sweep;
+
+            // seeds of the current nibble: all of them for the in-place
+            // version, those with neighbors for the ranking
+            std::vector<ImageID> seed;
+            std::vector<ImageID> active;
+
+            unsigned hash (ImageID v) const {
+                return (v * 2654435761U) >> (32 - bits);
+            }
+
+            void rehash (unsigned b) {
+                bits = b;
+                table.clear();
+                Entry e;
+                e.key = 0;
+                e.epoch = 0;
+                e.slot = 0;
+                table.resize(1U << bits, e);
+                epoch = 1;
+                for (unsigned i = 0; i < ids.size(); ++i) {
+                    unsigned h = hash(ids[i]);
+                    while (table[h].epoch == epoch) h = (h + 1) & (table.size() - 1);
+                    table[h].key = ids[i];
+                    table[h].epoch = epoch;
+                    table[h].slot = i;
+                }
+            }
+
+            void reset () {
+                ids.clear();
+                degree.clear();
+                p.clear();
+                r.clear();
+                queued.clear();
+                queue.clear();
+                head = 0;
+                ++epoch;
+                if (epoch == 0) rehash(bits);
+            }
+
+            unsigned find (ImageID v) const {
+                unsigned h = hash(v);
+                while (table[h].epoch == epoch) {
+                    if (table[h].key == v) return table[h].slot;
+                    h = (h + 1) & (table.size() - 1);
+                }
+                return NONE;
+            }
+
+            unsigned insert (ImageID v, const Graph &g) {
+                unsigned h = hash(v);
+                while (table[h].epoch == epoch) {
+                    if (table[h].key == v) return table[h].slot;
+                    h = (h + 1) & (table.size() - 1);
+                }
+                unsigned slot = ids.size();
+                ids.push_back(v);
+                degree.push_back(g.degree(v));
+                p.push_back(0);
+                r.push_back(0);
+                queued.push_back(0);
+                if ((ids.size() * 2) > table.size()) {
+                    rehash(bits + 1);
+                }
+                else {
+                    table[h].key = v;
+                    table[h].epoch = epoch;
+                    table[h].slot = slot;
+                }
+                return slot;
+            }
+
+            void push (unsigned slot) {
+                if (queued[slot]) return;
+                queued[slot] = 1;
+                queue.push_back(slot);
+            }
+
+            unsigned pop () {
+                unsigned slot = queue[head++];
+                if (head == queue.size()) {
+                    queue.clear();
+                    head = 0;
+                }
+                queued[slot] = 0;
+                return slot;
+            }
+
+            bool empty () const {
+                return head >= queue.size();
+            }
+
+        public:
+            Scratch (): bits(0), epoch(0), head(0) {
+                rehash(10);
+            }
+        };
+
+    private:
         const Graph &g;
         float alpha;
         float epsilon;
         unsigned maxit;
+        Scratch *scratch;
+        Poco::SharedPtr<Scratch> own;   // only when no scratch is given
 
-        struct Info {
-            float p, r;
-            Info (): p(0), r(0) {}
-        };
-
-        typedef std::map<ImageID, Info> PageRank;
+        bool big (unsigned u) const {
+            const Scratch &s = *scratch;
+            return (s.degree[u] > 0) && (s.r[u] / s.degree[u] >= epsilon);
+        }
 
-        void rank (std::vector<ImageID> vs, PageRank *ret)
+        void rank (const std::vector<ImageID> &vs)
         {
-            PageRank pr;
-            std::set<ImageID> big; // { u | r(u)/d(u) > epsilon }
+            Scratch &s = *scratch;
+            s.reset();
 
             BOOST_FOREACH(ImageID v, vs) {
-                Info &prv = pr[v];
-                prv.p = 0;
-                prv.r = 1.0F / vs.size();
-                if (prv.r / g.degree(v) >= epsilon) big.insert(v);
+                unsigned u = s.insert(v, g);
+                s.p[u] = 0;
+                s.r[u] = 1.0F / vs.size();
+                if (big(u)) s.push(u);
             }
 
             unsigned it = 0;
-            while (!big.empty()) {
+            while (!s.empty()) {
                 
                 if (it >= maxit) {
                     break;
                 }
-                ImageID u = *big.begin();
-
-                Info &pru = pr[u];
+                unsigned u = s.pop();
 
-                pru.p += alpha * pru.r;
-                pru.r *= (1 - alpha) / 2;
+                s.p[u] += alpha * s.r[u];
+                s.r[u] *= (1 - alpha) / 2;
 
-                float trans = pru.r / g.degree(u);
+                float trans = s.r[u] / s.degree[u];
 
-                if (trans < epsilon) {
-                    big.erase(u);
+                if (trans >= epsilon) {
+                    s.push(u);
                 }
 
-                BOOST_FOREACH(ImageID v, g.get(u)) {
-                    Info &prv = pr[v];
-                    prv.r += trans;
-                    if (prv.r / g.degree(v) >= epsilon) big.insert(v);
+                // slots may move while inserting, so no references here
+                BOOST_FOREACH(ImageID v, g.get(s.ids[u])) {
+                    unsigned w = s.insert(v, g);
+                    s.r[w] += trans;
+                    if (big(w)) s.push(w);
                 }
                 ++it;
             }
-
-            swap(pr, *ret);
-            
         }
 
 
         public:
 
-        Nibble (const Graph &g_, float alpha_, float epsilon_, unsigned maxit_)
-            : g(g_), alpha(alpha_), epsilon(epsilon_), maxit(maxit_) {
+        Nibble (const Graph &g_, float alpha_, float epsilon_, unsigned maxit_, Scratch *scratch_ = 0)
+            : g(g_), alpha(alpha_), epsilon(epsilon_), maxit(maxit_), scratch(scratch_) {
+            if (!scratch) {
+                own = new Scratch;
+                scratch = own.get();
+            }
         }
 
-        void nibble (std::vector<ImageID> seed,
+        // seed must not be a vector of the scratch memory
+        void nibble (const std::vector<ImageID> &seed,
                         std::vector<ImageID> *result) {
-            std::vector<ImageID> v;
+            Scratch &s = *scratch;
+            std::vector<ImageID> &v = s.active;
+            v.clear();
             result->clear();
 
             BOOST_FOREACH(ImageID i, seed) {
@@ -145,37 +333,37 @@ namespace nise {
             }
             if (v.empty()) return;
 
-            PageRank pr;
-            rank(v, &pr);
+            rank(v);
+
             // check S^p_j
             // compute p = apr(a, Xv, r)
-            std::vector<std::pair<float, ImageID> > sl;
-            BOOST_FOREACH(const PageRank::value_type &vt, pr) {
-                sl.push_back(std::make_pair(-vt.second.p / g.degree(vt.first), vt.first));
+            std::vector<std::pair<float, unsigned> > &sl = s.sweep;
+            sl.clear();
+            for (unsigned u = 0; u < s.ids.size(); ++u) {
+                sl.push_back(std::make_pair(s.degree[u] ? -s.p[u] / s.degree[u] : 0.0F, u));
             }
             std::sort(sl.begin(), sl.end());
 
-            //cerr << "!!" << sl.size() << "!!" << flush;
-
             unsigned top = 0, bottom = 0;
 
             float min_phi = std::numeric_limits<float>::max();
             unsigned min_idx = -1;
 
-            std::set<ImageID> seen;
+            s.swept.assign(s.ids.size(), 0);
 
             for (unsigned i = 0; i < unsigned(sl.size()); ++i ) {
                 unsigned cur = sl[i].second;
-                bottom += g.degree(cur);
-                BOOST_FOREACH(ImageID j, g.get(cur)) {
-                    if (seen.count(j)) {
+                bottom += s.degree[cur];
+                BOOST_FOREACH(ImageID j, g.get(s.ids[cur])) {
+                    unsigned k = s.find(j);
+                    if ((k != Scratch::NONE) && s.swept[k]) {
                         top -= 1;
                     }
                     else {
                         top += 1;
                     }
                 }
-                seen.insert(cur);
+                s.swept[cur] = 1;
 
                 float p = float(top)/float(bottom);
                 if (p < min_phi) {
@@ -184,12 +372,17 @@ namespace nise {
                 }
             }
 
-            //cerr << "**" << min_phi << "**" << flush << endl;
-            
             for (unsigned i = 0; i <= min_idx; ++i) {
-                result->push_back(sl[i].second);
+                result->push_back(s.ids[sl[i].second]);
             }
         }
+
+        // in place: the seeds are replaced by their expansion
+        void nibble (std::vector<ImageID> *seed_result) {
+            std::vector<ImageID> &seed = scratch->seed;
+            seed.assign(seed_result->begin(), seed_result->end());
+            nibble(seed, seed_result);
+        }
     };
 }
 
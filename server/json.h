@@ -1,90 +1,231 @@
 #ifndef WDONG_NISE_JSON
 #define WDONG_NISE_JSON
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <ostream>
 namespace nise {
 
+    // Number formatting straight into a string, without the locale and
+    // sentry overhead of operator<<.
+    static inline void AppendNumber (std::string *buf, unsigned long long v) {
+        char tmp[24];
+        char *p = tmp + sizeof(tmp);
+        do {
+            *--p = char('0' + v % 10);
+            v /= 10;
+        } while (v);
+        buf->append(p, tmp + sizeof(tmp) - p);
+    }
+
+    static inline void AppendNumber (std::string *buf, long long v) {
+        if (v < 0) {
+            buf->push_back('-');
+            AppendNumber(buf, 0ULL - (unsigned long long)v);
+        }
+        else {
+            AppendNumber(buf, (unsigned long long)v);
+        }
+    }
+
+    static inline void AppendNumber (std::string *buf, double v) {
+        char tmp[32];
+        int n = std::snprintf(tmp, sizeof(tmp), "%g", v);  // as operator<<
+        buf->append(tmp, n);
+    }
+
+    static inline void AppendNumber (std::string *buf, int v) { AppendNumber(buf, (long long)v); }
+    static inline void AppendNumber (std::string *buf, long v) { AppendNumber(buf, (long long)v); }
+    static inline void AppendNumber (std::string *buf, unsigned v) { AppendNumber(buf, (unsigned long long)v); }
+    static inline void AppendNumber (std::string *buf, unsigned long v) { AppendNumber(buf, (unsigned long long)v); }
+    static inline void AppendNumber (std::string *buf, float v) { AppendNumber(buf, double(v)); }
+
+    // Every writer of a thread formats into the same buffer, which is
+    // sent with a single write when the writer goes out of scope.  A
+    // writer given stream() formats in place instead: the response is
+    // then sent straight from the buffer by whoever owns it.
+    class ResponseBuffer {
+        // appends to the buffer, unbuffered so that writers formatting
+        // into the buffer directly stay in order
+        class Sink: public std::streambuf {
+            std::string &str;
+        protected:
+            virtual int_type overflow (int_type c) {
+                if (c != traits_type::eof()) str.push_back(char(c));
+                return traits_type::not_eof(c);
+            }
+
+            virtual std::streamsize xsputn (const char *s, std::streamsize n) {
+                str.append(s, n);
+                return n;
+            }
+        public:
+            Sink (std::string &s): str(s) {
+            }
+        };
+
+        std::string &buf;
+        std::string *&current;
+        bool owner;
+
+        static std::string *&slot () {
+            static thread_local std::string *p = 0;
+            return p;
+        }
+
+        static std::string &spare () {
+            static thread_local std::string s;
+            return s;
+        }
+    public:
+        static std::ostream &stream () {
+            static thread_local Sink sink(spare());
+            static thread_local std::ostream os(&sink);
+            return os;
+        }
+
+        ResponseBuffer ()
+            : buf(slot() ? *slot() : spare()), current(slot()), owner(slot() == 0) {
+            if (owner) {
+                buf.clear();
+                current = &buf;
+            }
+        }
+
+        ~ResponseBuffer () {
+            if (owner) {
+                current = 0;
+                if (buf.capacity() > RESPONSE_BUFFER_KEEP) {
+                    std::string().swap(buf);
+                }
+            }
+        }
+
+        std::string &get () {
+            return buf;
+        }
+    };
+
     class JSON {
         std::ostream &os;
+        ResponseBuffer buffer;
+        std::string &buf;
+        size_t begin;
+        bool direct;    // os is ResponseBuffer::stream()
         bool first;
         void sep () {
             if (first) {
                 first = false;
             }
             else {
-                os << ',';
+                buf.push_back(',');
             }
         }
+
+        void key (const std::string &k) {
+            sep();
+            buf.push_back('"');
+            buf.append(k);
+            buf.append("\":", 2);
+        }
+
+        void value (const std::string &val) {
+            buf.push_back('"');
+            buf.append(val);
+            buf.push_back('"');
+        }
+
+        void value (const char *val) {
+            buf.push_back('"');
+            buf.append(val);
+            buf.push_back('"');
+        }
+
+        void value (bool val) {
+            if (val) buf.append("true", 4);
+            else buf.append("false", 5);
+        }
+
+        template <typename T>
+        void value (T val) {
+            AppendNumber(&buf, val);
+        }
+
     public:
-        JSON (std::ostream &os_): os(os_), first(true) {
-            os << '{';
+        JSON (std::ostream &os_): os(os_), buf(buffer.get()), begin(buf.size()),
+            direct(&os == &ResponseBuffer::stream()), first(true) {
+            buf.push_back('{');
         }
 
         ~JSON () {
-            os << '}';
+            buf.push_back('}');
+            if (direct) return;
+            os.write(&buf[begin], buf.size() - begin);
+            buf.resize(begin);
         }
 
         JSON &add (const std::string &val) {
             sep();
-            os << '"' << val << '"';
+            value(val);
             return *this;
         }
 
         JSON &add (const char *val) {
             sep();
-            os << '"' << val << '"';
-            return *this;
-        }
-
-        JSON &add (bool val) {
-            sep();
-            os << (val ? "true" : "false");
+            value(val);
             return *this;
         }
 
         template <typename T>
         JSON &add (T val) {
             sep();
-            os << val;
+            value(val);
             return *this;
         }
 
-        JSON &add (const std::string &key, const std::string &val) {
-            sep();
-            os << '"' << key << "\":\"" << val << '"';
+        JSON &add (const std::string &k, const std::string &val) {
+            key(k);
+            value(val);
             return *this;
         }
 
-        JSON &add (const std::string &key, const char *val) {
-            sep();
-            os << '"' << key << "\":\"" << val << '"';
+        JSON &add (const std::string &k, const char *val) {
+            key(k);
+            value(val);
             return *this;
         }
 
-        JSON &add (const std::string &key, bool val) {
-            sep();
-            os << '"' << key << "\":" << (val ? "true" : "false");
+        template <typename T>
+        JSON &add (const std::string &k, T val) {
+            key(k);
+            value(val);
             return *this;
         }
 
         template <typename T>
-        JSON &add (const std::string &key, T val) {
-            sep();
-            os << '"' << key << "\":" << val;
-            return *this;
+        JSON &addArray (const std::string &k, const T *begin, const T *end) {
+            beginArray(k);
+            for (const T *p = begin; p < end; ++p) {
+                sep();
+                value(*p);
+            }
+            return endArray();
         }
 
-
         JSON &beginObject (const std::string &key) {
             sep();
             if (key.size()) {
-                os << '"' << key << "\":";
+                value(key);
+                buf.push_back(':');
             }
-            os << '{';
+            buf.push_back('{');
             first = true;
             return *this;
         }
 
         JSON &endObject () {
-            os << '}';
+            buf.push_back('}');
             first = false;
             return *this;
         }
@@ -92,18 +233,139 @@ namespace nise {
         JSON &beginArray (const std::string &key) {
             sep();
             if (key.size()) {
-                os << '"' << key << "\":";
+                value(key);
+                buf.push_back(':');
             }
-            os << '[';
+            buf.push_back('[');
             first = true;
             return *this;
         }
 
         JSON &endArray () {
-            os << ']';
+            buf.push_back(']');
             first = false;
             return *this;
         }
     };
+
+    // The compact binary counterpart of JSON for machine clients
+    // (format=bin), with the same add interface for the fields:
+    //
+    //   Signature::RESULT
+    //   fields, each:   varint key length, key, type, value
+    //                   type 'b': one byte
+    //                        'i': zigzag varint
+    //                        'f': 4-byte float
+    //                        's': varint length, bytes
+    //                        'p': a page of ids, see addPage
+    //                        'a': varint count, varints
+    class BIN {
+        std::ostream &os;
+        ResponseBuffer buffer;
+        std::string &buf;
+        size_t begin;
+        bool direct;    // os is ResponseBuffer::stream()
+
+        void key (const std::string &k) {
+            AppendVarint(&buf, k.size());
+            buf.append(k);
+        }
+
+        void value (const std::string &val) {
+            buf.push_back('s');
+            AppendVarint(&buf, val.size());
+            buf.append(val);
+        }
+
+        void value (bool val) {
+            buf.push_back('b');
+            buf.push_back(char(val));
+        }
+
+        void value (float val) {
+            buf.push_back('f');
+            buf.append(reinterpret_cast<const char *>(&val), sizeof(val));
+        }
+
+        void value (double val) {
+            value(float(val));
+        }
+
+        template <typename T>
+        void value (T val) {
+            buf.push_back('i');
+            AppendVarintSigned(&buf, int64_t(val));
+        }
+
+    public:
+        BIN (std::ostream &os_): os(os_), buf(buffer.get()), begin(buf.size()),
+            direct(&os == &ResponseBuffer::stream()) {
+            Signature::RESULT.append(&buf);
+        }
+
+        ~BIN () {
+            if (direct) return;
+            os.write(&buf[begin], buf.size() - begin);
+            buf.resize(begin);
+        }
+
+        BIN &add (const std::string &k, const std::string &val) {
+            key(k);
+            value(val);
+            return *this;
+        }
+
+        BIN &add (const std::string &k, const char *val) {
+            key(k);
+            value(std::string(val));
+            return *this;
+        }
+
+        template <typename T>
+        BIN &add (const std::string &k, T val) {
+            key(k);
+            value(val);
+            return *this;
+        }
+
+        BIN &addArray (const std::string &k, const unsigned *first, const unsigned *last) {
+            key(k);
+            buf.push_back('a');
+            AppendVarint(&buf, last - first);
+            for (const unsigned *p = first; p < last; ++p) {
+                AppendVarint(&buf, *p);
+            }
+            return *this;
+        }
+
+        // A page of ids is written as
+        //
+        //   varint count
+        //   varint delta[count]  # the ids sorted, each minus the previous
+        //   varint rank[count]   # position of each sorted id in the page
+        //
+        // The deltas of the sorted ids are much shorter varints than the
+        // ids themselves, and the ranks keep the result order.
+        BIN &addPage (const std::string &k, const ImageID *first, const ImageID *last) {
+            unsigned n = last - first;
+            std::vector<std::pair<ImageID, unsigned> > page(n);
+            for (unsigned i = 0; i < n; ++i) {
+                page[i] = std::make_pair(first[i], i);
+            }
+            std::sort(page.begin(), page.end());
+            key(k);
+            buf.push_back('p');
+            AppendVarint(&buf, n);
+            ImageID prev = 0;
+            for (unsigned i = 0; i < n; ++i) {
+                AppendVarint(&buf, page[i].first - prev);
+                prev = page[i].first;
+            }
+            for (unsigned i = 0; i < n; ++i) {
+                AppendVarint(&buf, page[i].second);
+            }
+            return *this;
+        }
+    };
 }
 #endif
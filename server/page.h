@@ -23,8 +23,9 @@ namespace nise {
                        public Poco::Net::PartHandler
         {
             unsigned num;
+            size_t max;
         public:
-            Uploads (unsigned n): num(n) {
+            Uploads (unsigned n, size_t m): num(n), max(m) {
             }
 
             void handlePart(const Poco::Net::MessageHeader& header,
@@ -45,7 +46,7 @@ namespace nise {
                 while (n > 0)
                 {
                     len += n;
-                    if (len > MAX_UPLOAD_SIZE) {
+                    if (size_t(len) > max) {
                         throw WebInputException("file too large");
                     }
                     str.append(buffer.begin(), static_cast<std::string::size_type>(n));
@@ -61,12 +62,14 @@ namespace nise {
 
         Uploads uploads;
         Poco::Net::HTMLForm form;
+        const Poco::Net::HTTPServerRequest &request;
 
     public:
-        WebInput (Poco::Net::HTTPServerRequest & request,
-                unsigned num_upload):
-            uploads(num_upload),
-            form(request, request.stream(), uploads)
+        WebInput (Poco::Net::HTTPServerRequest & request_,
+                unsigned num_upload, size_t max_upload = MAX_UPLOAD_SIZE):
+            uploads(num_upload, max_upload),
+            form(request_, request_.stream(), uploads),
+            request(request_)
         {
             if (uploads.size() != num_upload) {
                 throw WebInputException("too few uploads.");
@@ -122,6 +125,11 @@ namespace nise {
             }
             return it->second;
         }
+
+        // a request header, for what should not be in the URL
+        const std::string &header (const std::string &name, const std::string &def) const {
+            return request.get(name, def);
+        }
     };
 
     class Page {
@@ -132,22 +140,30 @@ namespace nise {
         enum ContentType {
             CONTENT_HTML = 0,
             CONTENT_JPEG,
-            CONTENT_JSON
+            CONTENT_JSON,
+            CONTENT_BINARY,
+            CONTENT_TEXT
         };
     private:
         void sendErrorMessage (Poco::Net::HTTPServerResponse& response,
-                               const std::string &message) const {
-            response.setStatus(Poco::Net::HTTPServerResponse::HTTP_BAD_REQUEST);
+                               const std::string &message,
+                               Poco::Net::HTTPResponse::HTTPStatus status = Poco::Net::HTTPResponse::HTTP_BAD_REQUEST) const {
+            response.setStatus(status);
             switch (contentType()) {
                 case CONTENT_HTML:
-                        response.send() << "<HTML><BODY>" << message
-                                       << "</BODY></HTML>" << std::endl;
+                    response.send() << "<HTML><BODY>" << message
+                                    << "</BODY></HTML>" << std::endl;
                     break;
                 case CONTENT_JPEG:
                     break;
-                case CONTENT_JSON:
+                case CONTENT_BINARY:
+                case CONTENT_TEXT:
+                    response.send() << message;
+                    break;
+                case CONTENT_JSON: {
                         JSON json(response.send());
                         json.add("error", message);
+                    }
                     break;
             }
         }
@@ -171,6 +187,16 @@ namespace nise {
             return 0;
         }
 
+        virtual size_t maxUploadSize () const {
+            return MAX_UPLOAD_SIZE;
+        }
+
+        // A chunked page is sent as output writes it, instead of being
+        // formatted in full first.
+        virtual bool chunked () const {
+            return false;
+        }
+
         virtual void input (const WebInput& in) {
             tag = in.get<std::string>("tag", "");
         }
@@ -185,11 +211,26 @@ namespace nise {
                     Poco::Net::HTTPServerResponse& response) {
             do {    // so we can use break to go to the end
                 try {
-                    WebInput in(request, numUploads());
+                    Poco::Timestamp parse;
+                    WebInput in(request, numUploads(), maxUploadSize());
+                    Metrics::instance().parse.add(parse.elapsed());
                     input(in);
+                } catch (const OverloadException &e) {
+                    response.set("Retry-After", boost::lexical_cast<std::string>(Admission::instance().getRetry()));
+                    response.setStatus(Poco::Net::HTTPServerResponse::HTTP_SERVICE_UNAVAILABLE);
+                    response.setContentLength(0);
+                    response.send();
+                    break;
                 } catch (const WebInputException &e) {
                     sendErrorMessage(response, e.displayText());
                     break;
+                } catch (const Poco::Exception &e) {
+                    // our failure, not the client's
+                    sendErrorMessage(response, e.displayText(), Poco::Net::HTTPResponse::HTTP_INTERNAL_SERVER_ERROR);
+                    break;
+                } catch (const std::exception &e) {
+                    sendErrorMessage(response, e.what(), Poco::Net::HTTPResponse::HTTP_INTERNAL_SERVER_ERROR);
+                    break;
                 }
                 try {
                     run();
@@ -209,10 +250,32 @@ namespace nise {
                                             response.setContentType(
                                             Poco::Net::MediaType("image/jpeg"));
                                     break;
+                        case CONTENT_BINARY:
+                                            response.setContentType(
+                                            Poco::Net::MediaType("application/octet-stream"));
+                                    break;
+                        case CONTENT_TEXT:
+                                            response.setContentType(
+                                            Poco::Net::MediaType("text/plain; version=0.0.4"));
+                                    break;
                         default:
                                     throw Poco::LogicException("undefined content type");
                     }
-                    output(response.send());
+                    if (chunked()) {
+                        response.setChunkedTransferEncoding(true);
+                        output(response.send());
+                        break;
+                    }
+                    // formatted in place, and sent in one piece with a
+                    // Content-Length
+                    ResponseBuffer buffer;
+                    {
+                        StageTimer stage(Metrics::instance().serialize);
+                        output(ResponseBuffer::stream());
+                    }
+                    const std::string &body = buffer.get();
+                    response.setContentLength(body.size());
+                    response.sendBuffer(body.data(), body.size());
                 }
                 catch (const std::exception &e) {
                     Log::system().error(e.what());
@@ -220,7 +283,7 @@ namespace nise {
                 }
             } while (0);
             if (log()) {
-                Log::access().information(
+                Log::logAccess(
                         boost::lexical_cast<std::string>(response.getStatus())
                         + ' ' + request.clientAddress().toString()
                         + ' ' + request.getMethod()
@@ -301,13 +364,103 @@ namespace nise {
 
         virtual void output (std::ostream &os) {
             nise::JSON json(os);
-            SketchDB::instance().stat(json);
+            Generation::get()->getSketchDB().stat(json);
+        }
+    };
+
+    // Prometheus text exposition of Metrics, plus queue depths.
+    class MetricsPage: public Page {
+    public:
+        virtual bool log () const {
+            return false;
+        }
+
+        virtual Page *construct () const {
+            return new MetricsPage;
+        }
+
+        virtual ContentType contentType () const {
+            return CONTENT_TEXT;
+        }
+
+        virtual void output (std::ostream &os) {
+            Metrics::instance().render(os);
+            TaskPool *pool = SearchPool::instance();
+            Metrics::gauge(os, "nise_search_pool_queue", "Feature searches waiting for a worker.",
+                           pool ? pool->backlog() : 0);
+            BatchScheduler *scheduler = BatchScheduler::instance();
+            Metrics::gauge(os, "nise_batch_queue", "Feature searches waiting for the batch scheduler.",
+                           scheduler ? scheduler->pending() : 0);
+            ExtractionPool *extraction = ExtractionPool::instance();
+            Metrics::gauge(os, "nise_extract_queue", "Query images waiting for extraction.",
+                           extraction ? extraction->pending() : 0);
+            Metrics::gauge(os, "nise_sessions", "Sessions in the cache.",
+                           SessionCache::instance().size());
+            Metrics::gauge(os, "nise_session_bytes", "Memory held by the cached sessions.",
+                           SessionCache::instance().getBytes());
+            Metrics::gauge(os, "nise_searches_in_flight", "Searches admitted and not finished.",
+                           Admission::instance().getInflight());
+            Metrics::gauge(os, "nise_search_latency_seconds", "Moving average of the search latency.",
+                           Admission::instance().getLatency() / 1000);
+            Metrics::gauge(os, "nise_index_generation", "Serial of the index generation in use.",
+                           Generation::get()->getSerial());
+            Metrics::gauge(os, "nise_index_generations", "Index generations in memory.",
+                           Generation::getAlive());
         }
     };
 
+    // Starts loading a new index generation, see Reloader.  Also reports
+    // the progress of a reload already running.  The key goes in a header
+    // so that it stays out of URLs and logs.
+    //
+    //   X-Admin-Key: <nise.admin.key>
+    //   /admin/reload[?config=<file>]
+    class AdminReloadPage: public Page {
+        std::string config;
+        bool started;
+    public:
+        AdminReloadPage (): started(false) {
+        }
+
+        virtual Page *construct () const {
+            return new AdminReloadPage;
+        }
+
+        virtual bool log () const {
+            return false;
+        }
+
+        virtual ContentType contentType () const {
+            return CONTENT_JSON;
+        }
+
+        virtual void input (const WebInput &in) {
+            Page::input(in);
+            if (!Reloader::instance().authorize(in.header("X-Admin-Key", ""))) {
+                throw WebInputException("not authorized");
+            }
+            config = in.get<std::string>("config", "");
+        }
+
+        virtual void run () {
+            started = Reloader::instance().start(config);
+        }
+
+        virtual void output (std::ostream &os) {
+            JSON json(os);
+            json.add("started", started)
+                .add("status", Reloader::instance().getStatus())
+                .add("generation", Generation::get()->getSerial())
+                .add("generations", Generation::getAlive());
+        }
+    };
+
+    // gen is the serial of the generation the id comes from, the
+    // current one if not given.
     class DataPage: public Page {
     protected:
         ImageID id;
+        int gen;
         Poco::SharedPtr<Record> record;
         bool hit;
     public:
@@ -316,15 +469,20 @@ namespace nise {
             return false;
         }
 
-        DataPage() : hit(false) {}
+        DataPage() : gen(-1), hit(false) {}
 
         virtual void input (const WebInput& in) {
             Page::input(in);
             id = in.get<ImageID>("id");
+            gen = in.get<int>("gen", -1);
             hit = 0;
         }
         virtual void run () {
-            record = ImageDB::instance().get(id, &hit);
+            Generation::Ptr generation = (gen < 0) ? Generation::get() : Generation::find(gen);
+            if (generation.isNull()) {
+                throw NotFoundException("index generation released.");
+            }
+            record = generation->getImageDB().get(id, &hit);
             if (record.isNull()) {
                 throw NotFoundException("record not found.");
             }
@@ -374,20 +532,94 @@ namespace nise {
         }
     };
 
+    // The images of the cluster of id, see ClusterMap.  gen is as for
+    // DataPage.
+    class ClusterPage: public Page {
+        ImageID id;
+        int gen;
+        Generation::Ptr generation;
+    public:
+        virtual Page *construct () const {
+            return new ClusterPage;
+        }
+
+        virtual bool log () const {
+            return false;
+        }
+
+        virtual ContentType contentType () const {
+            return CONTENT_JSON;
+        }
+
+        virtual void input (const WebInput& in) {
+            Page::input(in);
+            id = in.get<ImageID>("id");
+            gen = in.get<int>("gen", -1);
+        }
+
+        virtual void run () {
+            generation = (gen < 0) ? Generation::get() : Generation::find(gen);
+            if (generation.isNull()) {
+                throw NotFoundException("index generation released.");
+            }
+        }
+
+        virtual void output (std::ostream &os) {
+            const ClusterMap &clusters = generation->getClusters();
+            uint32_t c = clusters.get(id);
+            nise::JSON json(os);
+            json.add("id", id)
+                .add("count", clusters.size(c));
+            if (!tag.empty()) {
+                json.add("tag", tag);
+            }
+            if (c == ClusterMap::NONE) {
+                json.addArray("members", &id, &id + 1);
+            }
+            else {
+                ClusterMap::Range range = clusters.members(c);
+                json.addArray("members", range.first, range.second);
+            }
+        }
+    };
+
     class ResultPage: public Page {
     protected:
         bool dolog;
+        bool binary;
         unsigned start;
         unsigned count;
         unsigned time_limit;
         Poco::SharedPtr<Session> session;
+        Poco::SharedPtr<Admission::Ticket> ticket;
     public:
 
+        ResultPage (): binary(false) {
+        }
+
         virtual ContentType contentType () const {
-            return CONTENT_JSON;
+            return binary ? CONTENT_BINARY : CONTENT_JSON;
         }
+        // Only pages that start a new search go through admission, see
+        // Admission.
+        virtual bool admit () const {
+            return true;
+        }
+        // Whether the time of the request counts towards the latency of
+        // interactive searches.
+        virtual bool timed () const {
+            return true;
+        }
+        // Searches are admitted before the query is extracted or run.
         virtual void input (const WebInput& in) {
+            if (admit()) {
+                ticket = new Admission::Ticket(timed());
+                if (ticket->getLevel() == Admission::REJECTED) {
+                    throw OverloadException("too many searches");
+                }
+            }
             Page::input(in);
+            binary = (in.get("format", std::string("json")) == "bin");
             start = in.get<unsigned>("page_offset", 0);
             count = in.get<unsigned>("page_count", 0);
             time_limit = in.get<unsigned>("time_limit", TIME_LIMIT_DEFAULT);
@@ -397,9 +629,10 @@ namespace nise {
             Timer timer(time_limit);
             if (session->getType() == Session::RANDOM) start = 0;
             session->run(start + count, timer);
+            SessionCache::instance().charge(session);
         }
         virtual void output (std::ostream &os) {
-            session->serve(os, start, count, tag);
+            session->serve(os, start, count, tag, binary);
         }
 
         virtual bool log () const {
@@ -410,7 +643,9 @@ namespace nise {
             if (!session.isNull()) {
                 Poco::SharedPtr<Retrieval> rt = session->getRetrieval();
                 if (!rt.isNull()) {
-                    return StringToHex(rt->getRecord().checksum);
+                    return StringToHex(rt->getRecord().checksum)
+                        + ' ' + Session::stopName(session->getStop())
+                        + ' ' + boost::lexical_cast<std::string>(session->saved());
                 }
             }
             return "-";
@@ -433,6 +668,15 @@ namespace nise {
             param.box.right = in.get<float>("box.right", 1.0);
             param.box.bottom = in.get<float>("box.bottom", 1.0);
             param.crop = (in.get<int>("crop", 1) != 0);
+            param.stable = in.get<unsigned>("stop.stable", EARLY_STOP_STABLE);
+            param.stable_top = in.get<unsigned>("stop.top", EARLY_STOP_TOP);
+            param.margin = in.get<float>("stop.margin", EARLY_STOP_MARGIN);
+            param.verify = in.get<unsigned>("verify", 0);
+            param.verify_time = in.get<unsigned>("verify.time", VERIFY_TIME_DEFAULT);
+            param.features = in.get<unsigned>("features", 0);
+            param.interactive = log();
+            param.cluster = (in.get<int>("cluster", 1) != 0);
+            if (!ticket.isNull()) ticket->apply(&param);
         }
     };
 
@@ -446,7 +690,10 @@ namespace nise {
             SearchPage::input(in);
             url = in.get("url");
             std::string query;
-            Download(url, &query);
+            {
+                StageTimer stage(Metrics::instance().download);
+                Download(url, &query);
+            }
             if (query.empty()) {
                 throw WebInputException("bad URL");
             }
@@ -537,6 +784,167 @@ namespace nise {
         }
     };
 
+    // Many queries in one request, for offline clients such as dedup
+    // jobs.  The upload is a sequence of items, each either
+    //
+    //   Signature::RECORD, Record fields   (as tools/client --type 3)
+    //   Signature::IMAGE, uint32 length, JPEG
+    //
+    // The features of all items are searched with one DB::batch.  The
+    // results are streamed in item order as they are ranked, one JSON
+    // object per line, or with format=bin each BIN result preceded by its
+    // uint32 length.  The tag of an item is its position in the upload.
+    // The sessions are not cached, so there are no follow-up pages.
+    // Admitted as one search per item, once the items are known.  The
+    // query images are all submitted for extraction before any is waited
+    // for, so that they are extracted in parallel.
+    class SearchBatchPage: public SearchPage {
+        std::vector<Poco::SharedPtr<Session> > sessions;
+
+        struct Item {
+            Record record;
+            std::string image;      // if an image
+            bool is_image;
+            std::string checksum;
+            ExtractionPool::JobPtr job;
+        };
+
+        void extract (std::deque<Item> &items) {
+            Generation::Ptr generation = Generation::get();
+            ExtractionPool *pool = ExtractionPool::instance();
+            sessions.resize(items.size());
+            for (unsigned i = 0; i < items.size(); ++i) {
+                Item &item = items[i];
+                if (!item.is_image) continue;
+                Checksum(item.image, &item.checksum);
+                Poco::SharedPtr<Retrieval> retrieval = Session::lookup(item.checksum, generation);
+                if (!retrieval.isNull()) {
+                    sessions[i] = new Session(retrieval, param);
+                }
+                else if (pool == 0) {
+                    Extractor::local().extract(item.image, &item.record, true);
+                }
+                else {
+                    item.job = pool->submit(&item.image, param.interactive);
+                    if (item.job.isNull()) break;
+                }
+            }
+            try {
+                for (unsigned i = 0; i < items.size(); ++i) {
+                    Item &item = items[i];
+                    if (!sessions[i].isNull()) continue;
+                    if (!item.is_image) {
+                        sessions[i] = new Session(item.record, param);
+                        continue;
+                    }
+                    if (pool != 0) {
+                        if (item.job.isNull() || !pool->wait(item.job, &item.record)) {
+                            throw OverloadException("no extraction capacity");
+                        }
+                        item.job = 0;
+                    }
+                    Poco::SharedPtr<Retrieval> retrieval = Retrieval::fromRecord(item.record, generation);
+                    RetrievalCache::instance().add(item.checksum, retrieval);
+                    sessions[i] = new Session(retrieval, param);
+                }
+            }
+            catch (...) {
+                BOOST_FOREACH(Item &item, items) {
+                    if (!item.job.isNull()) pool->cancel(item.job);
+                }
+                throw;
+            }
+        }
+    public:
+        virtual Page *construct () const {
+            return new SearchBatchPage;
+        }
+        virtual unsigned numUploads () const  {
+            return 1;
+        }
+        virtual size_t maxUploadSize () const {
+            return BATCH_MAX_SIZE;
+        }
+        virtual bool chunked () const {
+            return true;
+        }
+        virtual bool admit () const {
+            return false;
+        }
+        virtual bool timed () const {
+            return false;
+        }
+        virtual void input (const WebInput& in) {
+            SearchPage::input(in);
+            const std::string &body = in.getUploads()[0].body;
+            MemoryInputStream ss(body.data(), body.data() + body.size());
+            std::deque<Item> items;     // not moved as it grows
+            for (;;) {
+                uint32_t sig = ReadUint32(ss);
+                if (!ss) break;
+                if (items.size() >= BATCH_MAX_ITEMS) {
+                    throw WebInputException("too many items");
+                }
+                items.push_back(Item());
+                Item &item = items.back();
+                item.is_image = Signature::IMAGE.check(sig);
+                if (Signature::RECORD.check(sig)) {
+                    item.record.readFields(ss);
+                    if (!ss) throw WebInputException("bad record");
+                }
+                else if (item.is_image) {
+                    uint32_t len = ReadUint32(ss);
+                    if (!ss || (len > MAX_UPLOAD_SIZE)) throw WebInputException("bad image");
+                    item.image.resize(len);
+                    if (len) ss.read(&item.image[0], len);
+                    if (!ss) throw WebInputException("bad image");
+                }
+                else {
+                    throw WebInputException("bad item");
+                }
+            }
+            ticket = new Admission::Ticket(timed(), items.size());
+            if (ticket->getLevel() == Admission::REJECTED) {
+                throw OverloadException("too many searches");
+            }
+            ticket->apply(&param);
+            param.batch = true;
+            extract(items);
+            if (log()) {
+                BOOST_FOREACH(const Poco::SharedPtr<Session> &session, sessions) {
+                    Log::saveRecord(session->getRetrieval()->getRecord());
+                }
+            }
+        }
+        virtual void run () {
+            Session::prefetch(sessions);
+        }
+        virtual void output (std::ostream &os) {
+            for (unsigned i = 0; i < sessions.size(); ++i) {
+                Timer timer(time_limit);
+                sessions[i]->run(start + count, timer);
+                std::string item = boost::lexical_cast<std::string>(i);
+                if (binary) {
+                    std::ostringstream bin(std::ios::binary);
+                    sessions[i]->serve(bin, start, count, item, true);
+                    const std::string &str = bin.str();
+                    WriteUint32(os, str.size());
+                    os.write(&str[0], str.size());
+                }
+                else {
+                    sessions[i]->serve(os, start, count, item);
+                    os << '\n';
+                }
+                // let go of what is already sent
+                sessions[i] = 0;
+            }
+            os.flush();
+        }
+        virtual std::string logMsg () const {
+            return boost::lexical_cast<std::string>(sessions.size()) + " items";
+        }
+    };
+
     class SearchLocalPage: public SearchPage {
     protected:
         ImageID id;
@@ -544,6 +952,9 @@ namespace nise {
         virtual Page *construct () const {
             return new SearchLocalPage;
         }
+        virtual bool admit () const {
+            return false;
+        }
         virtual void input (const WebInput &in) {
             SearchPage::input(in);
             id = in.get<unsigned>("id");
@@ -558,6 +969,9 @@ namespace nise {
         virtual Page *construct () const {
             return new SearchRandomPage;
         }
+        virtual bool admit () const {
+            return false;
+        }
         virtual void input (const WebInput &in) {
             SearchPage::input(in);
             start = 0;
@@ -572,12 +986,15 @@ namespace nise {
         virtual Page *construct () const {
             return new SearchUpdatePage;
         }
+        virtual bool admit () const {
+            return false;
+        }
         virtual void input (const WebInput &in) {
             SearchPage::input(in);
             start = 0;
             const std::string &id_txt = in.get("id");
             Poco::UUID id(id_txt);
-            session = SessionCache::instance().get(id);
+            session = SessionCache::lookup(id);
             if (session.isNull()) {
                 throw WebInputException("session timeout");
             }
@@ -590,11 +1007,14 @@ namespace nise {
         virtual Page *construct () const {
             return new SearchFollowUpPage;
         }
+        virtual bool admit () const {
+            return false;
+        }
         virtual void input (const WebInput &in) {
             SearchPage::input(in);
             const std::string &id_txt = in.get("id");
             Poco::UUID id(id_txt);
-            session = SessionCache::instance().get(id);
+            session = SessionCache::lookup(id);
             if (session.isNull()) {
                 throw WebInputException("session timeout");
             }
@@ -616,7 +1036,7 @@ namespace nise {
         virtual void input (const WebInput &in) {
             const std::string &id_txt = in.get("id");
             Poco::UUID id(id_txt);
-            Poco::SharedPtr<Session> session = SessionCache::instance().get(id);
+            Poco::SharedPtr<Session> session = SessionCache::lookup(id);
             if (session.isNull()) {
                 throw WebInputException("session timeout");
             }
@@ -639,14 +1059,18 @@ namespace nise {
         static DynamicContent inst;
         DynamicContent () {
             map["/stat"] = new StatPage;
+            map["/metrics"] = new MetricsPage;
+            map["/admin/reload"] = new AdminReloadPage;
             map["/thumb"] = new ThumbPage;
             map["/meta"] = new MetaPage;
+            map["/cluster"] = new ClusterPage;
             map["/demo/list"] = new DemoListPage;
             map["/demo/image"] = new DemoImagePage;
             map["/search/sha1"] = new SearchSHA1Page;
             map["/search/url"] = new SearchURLPage;
             map["/search/upload"] = new SearchUploadPage;
             map["/search/record"] = new SearchRecordPage;
+            map["/search/batch"] = new SearchBatchPage;
             map["/search/random"] = new SearchRandomPage;
             map["/search/demo"] = new SearchDemoPage;
             map["/search/local"] = new SearchLocalPage;
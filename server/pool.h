@@ -0,0 +1,207 @@
+#ifndef WDONG_NISE_POOL
+#define WDONG_NISE_POOL
+#include <deque>
+#include <vector>
+#include <climits>
+#include <sys/types.h>
+#include <boost/assert.hpp>
+#include <boost/foreach.hpp>
+#include <Poco/Mutex.h>
+#include <Poco/ScopedLock.h>
+#include <Poco/Semaphore.h>
+#include <Poco/Runnable.h>
+#include <Poco/Thread.h>
+
+namespace nise {
+
+    // A bounded multi-producer multi-consumer queue without locks
+    // (D. Vyukov's array queue).  Each cell carries a sequence number
+    // telling whether it is ready for the push or the pop of a given
+    // round.  push fails instead of blocking when the queue is full.
+    template <typename T>
+    class BoundedQueue {
+        struct Cell {
+            volatile size_t seq;
+            T data;
+        };
+
+        std::vector<Cell> cells;
+        size_t mask;
+        volatile size_t head;   // next to pop
+        volatile size_t tail;   // next to push
+
+    public:
+        BoundedQueue (size_t capacity): head(0), tail(0) {
+            size_t n = 1;
+            while (n < capacity) n <<= 1;
+            cells.resize(n);
+            mask = n - 1;
+            for (size_t i = 0; i < n; ++i) {
+                cells[i].seq = i;
+            }
+        }
+
+        bool push (const T &v) {
+            size_t pos = tail;
+            for (;;) {
+                Cell &cell = cells[pos & mask];
+                ssize_t diff = ssize_t(cell.seq) - ssize_t(pos);
+                if (diff == 0) {
+                    if (__sync_bool_compare_and_swap(&tail, pos, pos + 1)) {
+                        cell.data = v;
+                        __sync_synchronize();
+                        cell.seq = pos + 1;
+                        return true;
+                    }
+                }
+                else if (diff < 0) {
+                    return false;   // full
+                }
+                pos = tail;
+            }
+        }
+
+        bool pop (T *v) {
+            size_t pos = head;
+            for (;;) {
+                Cell &cell = cells[pos & mask];
+                ssize_t diff = ssize_t(cell.seq) - ssize_t(pos + 1);
+                if (diff == 0) {
+                    if (__sync_bool_compare_and_swap(&head, pos, pos + 1)) {
+                        *v = cell.data;
+                        __sync_synchronize();
+                        cell.seq = pos + mask + 1;
+                        return true;
+                    }
+                }
+                else if (diff < 0) {
+                    return false;   // empty
+                }
+                pos = head;
+            }
+        }
+
+        // approximate while pushes or pops are in progress
+        size_t size () const {
+            return tail - head;
+        }
+    };
+
+    // A fixed set of worker threads, each owning a deque of tasks.
+    // Submitted tasks are dealt round-robin to the workers; a worker
+    // pops from the front of its own deque and, when that runs dry,
+    // steals from the back of the others'.
+    class TaskPool {
+    public:
+        class Task {
+        public:
+            virtual ~Task () {
+            }
+            virtual void run () = 0;
+        };
+
+    private:
+        struct Worker: public Poco::Runnable {
+            TaskPool *pool;
+            unsigned index;
+            std::deque<Task *> queue;
+            Poco::FastMutex mutex;
+            Poco::Thread thread;
+
+            void run () {
+                pool->work(index);
+            }
+        };
+
+        std::vector<Worker *> workers;
+        // one permit per queued task, plus one per worker on shutdown
+        Poco::Semaphore pending;
+        unsigned next;
+        unsigned queued;
+
+        Task *take (unsigned idx) {
+            {
+                Worker &own = *workers[idx];
+                Poco::ScopedLock<Poco::FastMutex> lock(own.mutex);
+                if (!own.queue.empty()) {
+                    Task *task = own.queue.front();
+                    own.queue.pop_front();
+                    __sync_fetch_and_sub(&queued, 1);
+                    return task;
+                }
+            }
+            for (unsigned i = 1; i < workers.size(); ++i) {
+                Worker &victim = *workers[(idx + i) % workers.size()];
+                Poco::ScopedLock<Poco::FastMutex> lock(victim.mutex);
+                if (!victim.queue.empty()) {
+                    Task *task = victim.queue.back();
+                    victim.queue.pop_back();
+                    __sync_fetch_and_sub(&queued, 1);
+                    return task;
+                }
+            }
+            return 0;
+        }
+
+        void work (unsigned idx) {
+            for (;;) {
+                pending.wait();
+                Task *task = take(idx);
+                if (task == 0) break;   // only happens on shutdown
+                task->run();
+                delete task;
+            }
+        }
+
+    public:
+        TaskPool (unsigned threads): pending(0, INT_MAX), next(0), queued(0) {
+            BOOST_VERIFY(threads > 0);
+            workers.resize(threads);
+            for (unsigned i = 0; i < threads; ++i) {
+                workers[i] = new Worker;
+                workers[i]->pool = this;
+                workers[i]->index = i;
+            }
+            BOOST_FOREACH(Worker *w, workers) {
+                w->thread.start(*w);
+            }
+        }
+
+        // Queued tasks are still run before the workers exit.
+        ~TaskPool () {
+            for (unsigned i = 0; i < workers.size(); ++i) {
+                pending.set();
+            }
+            BOOST_FOREACH(Worker *w, workers) {
+                w->thread.join();
+            }
+            BOOST_FOREACH(Worker *w, workers) {
+                BOOST_VERIFY(w->queue.empty());
+                delete w;
+            }
+        }
+
+        unsigned size () const {
+            return workers.size();
+        }
+
+        // # tasks waiting for a worker
+        unsigned backlog () const {
+            return queued;
+        }
+
+        // The pool takes the ownership of the task.
+        void submit (Task *task) {
+            Worker &w = *workers[__sync_fetch_and_add(&next, 1) % workers.size()];
+            {
+                Poco::ScopedLock<Poco::FastMutex> lock(w.mutex);
+                w.queue.push_back(task);
+                __sync_fetch_and_add(&queued, 1);
+            }
+            pending.set();
+        }
+    };
+}
+
+#endif
+
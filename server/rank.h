@@ -0,0 +1,183 @@
+#ifndef WDONG_NISE_RANK
+#define WDONG_NISE_RANK
+#include <vector>
+#include <algorithm>
+#include <boost/foreach.hpp>
+
+namespace nise {
+
+    // Ranks the candidates of an image query by the votes of the query
+    // features that matched them.  Only the best k candidates are kept in
+    // order; ties are broken by the order of first appearance, so with one
+    // vote each the ranking is the old first-seen order.  Each feature
+    // votes for a candidate at most once, see next, so a feature still to
+    // come can add at most one vote to any candidate.
+    //
+    // A candidate is identified by a key, e.g. the cluster of
+    // near-identical images the voted image belongs to, and represented in
+    // top by the first image voted under that key.
+    //
+    // The candidates are stored densely in the order of first vote and
+    // found through an open-addressing table of their positions, which
+    // takes about a third of the memory of a node-based map.
+    class Ranking {
+        struct Candidate {
+            ImageID key;
+            ImageID id;         // representative
+            float votes;
+            unsigned feature;   // the last feature that voted
+            bool top;
+        };
+
+        // candidates are identified by their position, which is also the
+        // order of first appearance
+        struct Better {
+            const std::vector<Candidate> &cands;
+            Better (const std::vector<Candidate> &c): cands(c) {
+            }
+            bool operator () (unsigned a, unsigned b) const {
+                if (cands[a].votes != cands[b].votes) return cands[a].votes > cands[b].votes;
+                return a < b;
+            }
+        };
+
+        unsigned k;
+        std::vector<Candidate> cands;
+        std::vector<unsigned> table;    // position + 1, 0 if empty
+        unsigned mask;
+        unsigned total;                 // # candidates, survives release
+        unsigned feature;               // the feature voting
+        std::vector<unsigned> changed;  // voted since the last update
+        std::vector<unsigned> list;     // the best k, best first
+        std::vector<ImageID> ids;       // ids of list
+
+        static unsigned hash (ImageID id) {
+            unsigned h = id * 0x9E3779B1U;
+            return h ^ (h >> 16);
+        }
+
+        unsigned slot (ImageID key) const {
+            unsigned h = hash(key) & mask;
+            while (table[h] && (cands[table[h] - 1].key != key)) {
+                h = (h + 1) & mask;
+            }
+            return h;
+        }
+
+        void grow () {
+            unsigned size = table.empty() ? 256 : table.size() * 2;
+            table.assign(size, 0);
+            mask = size - 1;
+            for (unsigned i = 0; i < cands.size(); ++i) {
+                table[slot(cands[i].key)] = i + 1;
+            }
+        }
+
+    public:
+        Ranking (unsigned k_): k(k_), mask(0), total(0), feature(0) {
+        }
+
+        void clear () {
+            cands.clear();
+            table.clear();
+            mask = 0;
+            total = 0;
+            feature = 0;
+            changed.clear();
+            list.clear();
+            ids.clear();
+        }
+
+        // Frees the votes once the ranking is final; top and candidates
+        // stay valid.
+        void release () {
+            std::vector<Candidate>().swap(cands);
+            std::vector<unsigned>().swap(table);
+            std::vector<unsigned>().swap(changed);
+            std::vector<unsigned>().swap(list);
+            mask = 0;
+        }
+
+        // The votes that follow are those of another feature.
+        void next () {
+            ++feature;
+        }
+
+        // A vote of the feature for image id, counted for key.  Repeated
+        // votes of the same feature for a key are ignored.
+        void vote (ImageID id, ImageID key, float weight = 1.0F) {
+            // keep the load factor at most 1/2
+            if ((cands.size() + 1) * 2 > table.size()) grow();
+            unsigned h = slot(key);
+            if (table[h] == 0) {
+                Candidate c;
+                c.key = key;
+                c.id = id;
+                c.votes = 0;
+                c.feature = unsigned(-1);
+                c.top = false;
+                cands.push_back(c);
+                table[h] = cands.size();
+                ++total;
+            }
+            unsigned i = table[h] - 1;
+            if (cands[i].feature == feature) return;
+            cands[i].feature = feature;
+            cands[i].votes += weight;
+            changed.push_back(i);
+        }
+
+        // Merges the votes cast since the last update into the top k.
+        // Votes only grow, so a candidate outside the top k can only enter
+        // it by being voted.
+        void update () {
+            if (changed.empty()) return;
+            Better better(cands);
+            bool full = list.size() >= k;
+            // the members might have been voted too, so find the worst again
+            unsigned worst = full ? *std::max_element(list.begin(), list.end(), better) : 0;
+            BOOST_FOREACH(unsigned i, changed) {
+                Candidate &c = cands[i];
+                if (c.top) continue;
+                if (full && !better(i, worst)) continue;
+                c.top = true;
+                list.push_back(i);
+            }
+            changed.clear();
+            std::sort(list.begin(), list.end(), better);
+            while (list.size() > k) {
+                cands[list.back()].top = false;
+                list.pop_back();
+            }
+            ids.resize(list.size());
+            for (unsigned i = 0; i < list.size(); ++i) {
+                ids[i] = cands[list[i]].id;
+            }
+        }
+
+        const std::vector<ImageID> &top () const {
+            return ids;
+        }
+
+        float score (ImageID key) const {
+            if (table.empty()) return 0;
+            unsigned h = slot(key);
+            if (table[h] == 0) return 0;
+            return cands[table[h] - 1].votes;
+        }
+
+        unsigned candidates () const {
+            return total;
+        }
+
+        // heap memory held
+        size_t bytes () const {
+            return cands.capacity() * sizeof(Candidate)
+                + (table.capacity() + changed.capacity() + list.capacity()) * sizeof(unsigned)
+                + ids.capacity() * sizeof(ImageID);
+        }
+    };
+}
+
+#endif
+
@@ -34,57 +34,75 @@
 #include "../common/nise.h"
 #include "server.h"
 #include "page.h"
+#ifdef __linux__
+#include "event.h"
+#endif
 
 namespace nise {
 
 // query cache
 Log Log::inst; 
-SketchDB *SketchDB::inst;
-Expansion *Expansion::inst;
+Generation::Ptr Generation::current;
+std::map<unsigned, Generation::Ptr> Generation::previous;
+Poco::FastMutex Generation::mutex;
+Poco::Mutex Generation::loading;
+int Generation::alive;
+Reloader *Reloader::inst;
+TaskPool *SearchPool::inst;
+ExtractionPool *ExtractionPool::inst;
+BackgroundFetcher *BackgroundFetcher::inst;
+BatchScheduler *BatchScheduler::inst;
 StaticContent *StaticContent::inst;
-ImageDB * ImageDB::inst;
 DynamicContent DynamicContent::inst;
 Demo * Demo::inst;
 Poco::LRUCache<std::string, Retrieval> *RetrievalCache::inst;
-Poco::AccessExpireCache<Poco::UUID, Session> *SessionCache::inst;
+RetrievalStore *RetrievalStore::inst;
+SessionCache *SessionCache::inst;
+Admission *Admission::inst;
 Poco::UUIDGenerator Session::uuid;
 
 POCO_IMPLEMENT_EXCEPTION(WebInputException, Poco::ApplicationException, "WEB INPUT");
 POCO_IMPLEMENT_EXCEPTION(NotFoundException, Poco::ApplicationException, "NOT FOUND");
+POCO_IMPLEMENT_EXCEPTION(OverloadException, Poco::ApplicationException, "OVERLOAD");
 
-class HTTPRequestHandler: public Poco::Net::HTTPRequestHandler {
+// Serves a request with either front end.
+static void HandleRequest (Poco::Net::HTTPServerRequest& request,
+                           Poco::Net::HTTPServerResponse& response) {
+    std::string uri = request.getURI();
 
-public:
-    void handleRequest (Poco::Net::HTTPServerRequest& request,
-                        Poco::Net::HTTPServerResponse& response) {
-        std::string uri = request.getURI();
-
-        {
-            Poco::SharedPtr<Page> page = DynamicContent::construct(Poco::URI(uri).getPath());
-            if (!page.isNull()) {
-                page->serve(request, response);
-                return;
-            }
+    {
+        Poco::SharedPtr<Page> page = DynamicContent::construct(Poco::URI(uri).getPath());
+        if (!page.isNull()) {
+            page->serve(request, response);
+            return;
         }
-        
-        {
-            if (uri == "/") {
-                const std::string &lang = request.get("Accept-Language", "");
-                if (lang.find("zh") != lang.npos) {
-                    uri = "/index-cn.html";
-                }
-                else {
-                    uri = "/index.html";
-                }
+    }
+    
+    {
+        if (uri == "/") {
+            const std::string &lang = request.get("Accept-Language", "");
+            if (lang.find("zh") != lang.npos) {
+                uri = "/index-cn.html";
             }
-            const Poco::SharedPtr<StaticContent::Page> page(StaticContent::instance().get(uri));
-            if (!page.isNull()) {
-                response.setContentType(page->mime);
-                response.send().write(&page->content[0], page->content.size());
-                return;
+            else {
+                uri = "/index.html";
             }
         }
-        response.setStatus(Poco::Net::HTTPResponse::HTTP_NOT_FOUND);
+        const Poco::SharedPtr<StaticContent::Page> page(StaticContent::instance().get(uri));
+        if (!page.isNull()) {
+            StaticContent::serve(*page, request, response);
+            return;
+        }
+    }
+    response.setStatus(Poco::Net::HTTPResponse::HTTP_NOT_FOUND);
+}
+
+class HTTPRequestHandler: public Poco::Net::HTTPRequestHandler {
+
+public:
+    void handleRequest (Poco::Net::HTTPServerRequest& request,
+                        Poco::Net::HTTPServerResponse& response) {
+        HandleRequest(request, response);
     }
 };
 
@@ -171,48 +189,87 @@ protected:
             }
 
             Log::system().information("Starting...");
-            ImageDB::init(config());
-            SketchDB::init(config());
-            Expansion::init(config());
+            const std::string &projection = config().getString("nise.sketch.projection", "");
+            if (!projection.empty() && !Extractor::checkProjection(projection)) {
+                Log::system().error("LSH projection differs from " + projection + ".");
+                return Poco::Util::Application::EXIT_CONFIG;
+            }
+            // the server threads, also what admission control budgets for
+            int threads = config().getInt("nise.server.threads", Poco::Environment::processorCount());
+            Generation::init(config());
+            SearchPool::init(config());
+            ExtractionPool::init(config());
+            BatchScheduler::init(config());
             RetrievalCache::init(config());
+            RetrievalStore::init(config());
+            Reloader::init(config());
             SessionCache::init(config());
+            Admission::init(config(), threads);
             StaticContent::init(config());
             DynamicContent::init(config());
             Demo::init(config());
+            BackgroundFetcher::init(config());
 
             Poco::Net::HTTPServerParams::Ptr param = new Poco::Net::HTTPServerParams;
             param->setServerName(config().getString("nise.server.name", "nise"));
-            param->setMaxThreads(config().getInt("nise.server.threads", 1));
-            param->setKeepAlive(config().getBool("nise.server.keepalive", false));
-            Poco::Net::ServerSocket svs(config().getInt("nise.server.port", 80));
-            Poco::Net::HTTPServer srv(new RequestHandlerFactory,
-                              svs, param);
+            param->setMaxThreads(threads);
+            param->setKeepAlive(config().getBool("nise.server.keepalive", true));
+            // bound the connection backlog, admission control handles the rest
+            param->setMaxQueued(config().getInt("nise.server.queue", SERVER_QUEUE_DEFAULT));
+
+            // the Poco server is the fallback where epoll is not available
+#ifdef __linux__
+            const std::string &frontend = config().getString("nise.server.frontend", "epoll");
+#else
+            const std::string &frontend = config().getString("nise.server.frontend", "poco");
+#endif
+            Poco::SharedPtr<Poco::Net::ServerSocket> svs;
+            Poco::SharedPtr<Poco::Net::HTTPServer> srv;
+#ifdef __linux__
+            Poco::SharedPtr<EventServer> esrv;
+            if (frontend == "epoll") {
+                esrv = new EventServer(&HandleRequest, config(), param);
+            }
+            else
+#endif
+            if (frontend == "poco") {
+                svs = new Poco::Net::ServerSocket(config().getInt("nise.server.port", 80));
+                srv = new Poco::Net::HTTPServer(new RequestHandlerFactory, *svs, param);
+            }
+            else {
+                Log::system().error("Unknown front end " + frontend + ".");
+                return Poco::Util::Application::EXIT_CONFIG;
+            }
 
             dropPrivilege();
 
             Log::system().information("Server is up.");
 
-            BackgroundFetcher bg;
-            Poco::Thread thread;
-            thread.setPriority(Poco::Thread::PRIO_LOWEST);
-            thread.start(bg);
-
-            srv.start();
+            if (!srv.isNull()) srv->start();
+#ifdef __linux__
+            if (!esrv.isNull()) esrv->start();
+#endif
+            Log::system().information("Front end: " + frontend + ".");
             waitForTerminationRequest();
             Log::system().information("Shutting down...");
-            srv.stop();
-
-            bg.stop();
-            thread.join();
+            if (!srv.isNull()) srv->stop();
+#ifdef __linux__
+            if (!esrv.isNull()) esrv->stop();
+#endif
 
+            BackgroundFetcher::cleanup();
             Demo::cleanup();
             DynamicContent::cleanup();
             StaticContent::cleanup();
+            Admission::cleanup();
             SessionCache::cleanup();
+            Reloader::cleanup();
+            RetrievalStore::cleanup();
             RetrievalCache::cleanup();
-            Expansion::cleanup();
-            SketchDB::cleanup();
-            ImageDB::cleanup();
+            BatchScheduler::cleanup();
+            ExtractionPool::cleanup();
+            SearchPool::cleanup();
+            Generation::cleanup();
             Log::system().information("Server is down.");
         }
         return Poco::Util::Application::EXIT_OK;
@@ -1,28 +1,48 @@
 #ifndef WDONG_NISE_SERVER
 #define WDONG_NISE_SERVER
 
+#include <list>
+#include <set>
 #include <Poco/UUID.h>
 #include <Poco/Mutex.h>
+#include <Poco/Event.h>
+#include <Poco/Environment.h>
 #include <Poco/Runnable.h>
 #include <Poco/ScopedLock.h>
 #include <Poco/LRUCache.h>
 #include <Poco/DirectoryIterator.h>
+#include <Poco/DeflatingStream.h>
+#include <Poco/DateTimeFormat.h>
+#include <Poco/DateTimeFormatter.h>
+#include <Poco/DateTimeParser.h>
+#include <Poco/StringTokenizer.h>
 #include <Poco/Util/AbstractConfiguration.h>
+#include <Poco/Util/XMLConfiguration.h>
 #include <Poco/Stopwatch.h>
 #include <Poco/Logger.h>
 #include <Poco/PatternFormatter.h>
 #include <Poco/FormattingChannel.h>
 #include <Poco/FileChannel.h>
+#include <Poco/File.h>
+#include <Poco/Exception.h>
 #include <Poco/AutoPtr.h>
 #include <fbi.h>
 
 #include "../image/extractor.h"
+#include "../common/metrics.h"
 #include "expand.h"
+#include "cluster.h"
 #include "json.h"
+#include "pool.h"
+#include "rank.h"
+#include "verify.h"
 
 
 namespace nise {
 
+    // a search was turned away for lack of capacity, answered with 503
+    POCO_DECLARE_EXCEPTION(, OverloadException, Poco::ApplicationException);
+
     class Timer {
         Poco::Stopwatch watch;
         int64_t t;
@@ -40,41 +60,153 @@ namespace nise {
         }
     };
 
-    class Log {
+    // The system log, the access log and the query records.  Access log
+    // lines and records are handed to a background writer through a
+    // bounded queue, and dropped (and counted) if the writer falls
+    // behind, so logging never blocks a request.  Records are appended
+    // to segment files under <nise.log.dir>/record:
+    //
+    //   records-N.dat: Signature::RECORD, Record, ...
+    //   records-N.idx: checksum, uint64 offset in records-N.dat, ...
+    //
+    // The indexes are loaded on startup, and a new segment is started on
+    // each startup or when the current one exceeds LOG_SEGMENT_SIZE.
+    class Log: public Poco::Runnable {
+        struct Item {
+            Record *record;     // or an access log line
+            std::string line;
+        };
+
+        struct Location {
+            unsigned segment;
+            uint64_t offset;
+        };
+
         bool record;
         std::string dir;
         Poco::Logger *sys;
         Poco::Logger *acc;
 
-        Log (): sys(0), acc(0)
+        BoundedQueue<Item *> *queue;
+        volatile bool stopping;
+        Poco::Event wake;
+        Poco::Thread thread;
+
+        // owned by the writer thread
+        unsigned segment;
+        std::ofstream data;
+        std::ofstream index;
+        uint64_t offset;
+        std::vector<std::pair<std::string, Location> > written;
+
+        std::map<std::string, Location> records;   // by checksum
+        Poco::FastMutex mutex;                     // protects records
+
+        Log (): sys(0), acc(0), queue(0), stopping(false), segment(0), offset(0)
         {
         }
 
         static Log inst;
 
+        std::string segmentPath (unsigned n, const char *ext) const {
+            return dir + "/record/records-" + boost::lexical_cast<std::string>(n) + ext;
+        }
+
+        // records saved one per file before segments were used
         std::string checksumToPath (const std::string &cs) {
             std::string hex(StringToHex(cs));
             return dir + "/record/" + hex.substr(0, 2) + '/' + hex;
         }
 
         void initRecordDirectory () {
-            static const char digits[] = "0123456789abcdef";
             if ((!record) || dir.empty()) return;
+            Poco::File(dir + "/record").createDirectories();
+            Poco::DirectoryIterator end;
+            for (Poco::DirectoryIterator it(dir + "/record"); it != end; ++it) {
+                const std::string &name = it.name();
+                if ((name.size() <= 12) || (name.compare(0, 8, "records-") != 0)
+                        || (name.compare(name.size() - 4, 4, ".idx") != 0)) continue;
+                unsigned n;
+                try {
+                    n = boost::lexical_cast<unsigned>(name.substr(8, name.size() - 12));
+                }
+                catch (const boost::bad_lexical_cast &) {
+                    continue;
+                }
+                segment = std::max(segment, n + 1);
+                std::ifstream is(it->path().c_str(), std::ios::binary);
+                for (;;) {
+                    std::string checksum;
+                    ReadString(is, &checksum);
+                    Location loc;
+                    loc.segment = n;
+                    loc.offset = ReadUint64(is);
+                    if (!is) break;
+                    records[checksum] = loc;
+                }
+            }
+        }
+
+        void openSegment () {
+            data.close();
+            index.close();
+            data.open(segmentPath(segment, ".dat").c_str(), std::ios::binary | std::ios::app);
+            index.open(segmentPath(segment, ".idx").c_str(), std::ios::binary | std::ios::app);
+            offset = 0;
+        }
+
+        void write (Item *item) {
+            if (item->record == 0) {
+                acc->information(item->line);
+                return;
+            }
+            const Record &rec = *item->record;
             {
-                Poco::File sub(dir + "/record");
-                if (sub.exists()) return;
-                sub.createDirectory();
+                Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+                if (records.count(rec.checksum)) return;
             }
-            char path[11] = "/record/00";
-            for (unsigned i = 0; i < 16; ++i) {
-                path[8] = digits[i];
-                for (unsigned j = 0; j < 16; ++j) {
-                    path[9] = digits[j];
-                    Poco::File sub(dir + path);
-                    sub.createDirectory();
-                }
+            for (unsigned i = 0; i < written.size(); ++i) {
+                if (written[i].first == rec.checksum) return;
+            }
+            if (!data.is_open() || (offset >= LOG_SEGMENT_SIZE)) {
+                if (data.is_open()) ++segment;
+                openSegment();
+            }
+            Location loc;
+            loc.segment = segment;
+            loc.offset = offset;
+            Signature::RECORD.write(data);
+            rec.write(data);
+            WriteString(index, rec.checksum);
+            WriteUint64(index, offset);
+            offset = data.tellp();
+            written.push_back(std::make_pair(rec.checksum, loc));
+        }
+
+        // Records become visible to loadRecord once flushed.
+        void flush () {
+            if (written.empty()) return;
+            data.flush();
+            index.flush();
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            for (unsigned i = 0; i < written.size(); ++i) {
+                records.insert(written[i]);
+            }
+            written.clear();
+        }
+
+        static void enqueue (Item *item) {
+            if ((inst.queue != 0) && inst.queue->push(item)) return;
+            if (item->record) {
+                Metrics::instance().log_dropped_records.add();
+            }
+            else {
+                Metrics::instance().log_dropped_lines.add();
             }
+            delete item->record;
+            delete item;
         }
+
     public:
         static void init (const Poco::Util::AbstractConfiguration &config) {
             BOOST_VERIFY(inst.sys == 0); 
@@ -109,15 +241,41 @@ namespace nise {
                 }
                 inst.initRecordDirectory();
             }
+            inst.queue = new BoundedQueue<Item *>(config.getInt("nise.log.queue", LOG_QUEUE_DEFAULT));
+            inst.stopping = false;
+            inst.thread.start(inst);
             system().information("Logging subsystem started.");
         }
 
         static void cleanup () {
             system().information("Logging subsystem stopped.");
+            inst.stopping = true;
+            inst.wake.set();
+            inst.thread.join();
+            delete inst.queue;
+            inst.queue = 0;
+            inst.data.close();
+            inst.index.close();
             inst.sys = 0;
             inst.acc = 0;
         }
 
+        // the writer thread, drains the queue every LOG_FLUSH_INTERVAL
+        void run () {
+            for (;;) {
+                bool last = stopping;
+                Item *item;
+                while (queue->pop(&item)) {
+                    write(item);
+                    delete item->record;
+                    delete item;
+                }
+                flush();
+                if (last) break;
+                wake.tryWait(LOG_FLUSH_INTERVAL);
+            }
+        }
+
         static Poco::Logger &system () {
             return *inst.sys;
         }
@@ -126,24 +284,44 @@ namespace nise {
             return *inst.acc;
         }
 
+        // writes a line to the access log in the background
+        static void logAccess (const std::string &line) {
+            Item *item = new Item;
+            item->record = 0;
+            item->line = line;
+            enqueue(item);
+        }
+
         static bool loadRecord (const std::string &checksum, Record *rec) {
             if ((!inst.record) || inst.dir.empty()) return false;
-            std::ifstream is(inst.checksumToPath(checksum).c_str(), std::ios::binary);
+            std::string path;
+            uint64_t offset = 0;
+            {
+                Poco::ScopedLock<Poco::FastMutex> lock(inst.mutex);
+                std::map<std::string, Location>::const_iterator it = inst.records.find(checksum);
+                if (it != inst.records.end()) {
+                    path = inst.segmentPath(it->second.segment, ".dat");
+                    offset = it->second.offset;
+                }
+                else {
+                    path = inst.checksumToPath(checksum);
+                }
+            }
+            std::ifstream is(path.c_str(), std::ios::binary);
             if (!is) return false;
+            is.seekg(offset);
             nise::Signature::RECORD.check(is);
             if (!is) return false;
             rec->readFields(is);
             return bool(is);
         }
 
+        // saves a copy of the record in the background
         static void saveRecord (const Record &rec) {
             if ((!inst.record) || inst.dir.empty()) return;
-            Poco::File file(inst.checksumToPath(rec.checksum));
-            if (!file.exists()) {
-                std::ofstream os(file.path().c_str(), std::ios::binary);
-                nise::Signature::RECORD.write(os);
-                rec.write(os);
-            }
+            Item *item = new Item;
+            item->record = new Record(rec);
+            enqueue(item);
         }
     };
 
@@ -151,7 +329,7 @@ namespace nise {
     class SketchDB {
         fbi::DB db;
         Poco::Mutex mutex;
-
+    public:
         SketchDB (const std::string &path)
             : db(path) {
         }
@@ -159,39 +337,43 @@ namespace nise {
         ~SketchDB () {
         }
 
-        static SketchDB *inst;
-    public:
-        static void init (const Poco::Util::AbstractConfiguration &config) {
-            BOOST_VERIFY(inst == NULL);
-            inst = new SketchDB(config.getString("nise.sketch.db"));
-            Log::system().information("Sketch database started.");
-        }
-
-        static void cleanup (void) {
-            BOOST_VERIFY(inst != 0);
-            delete inst;
-            inst = 0;
-            Log::system().information("Sketch database stopped.");
+        // Bytes are accounted per query by the caller, see Retrieval.
+        static void account (const fbi::ScanStat &st) {
+            Metrics &metrics = Metrics::instance();
+            metrics.plan.add(st.plan / 1000);
+            metrics.scan_io.add(st.io / 1000);
+            metrics.scan_cpu.add(st.cpu / 1000);
         }
 
-        static SketchDB &instance () {
-            return *inst;
-        }
-
-        void search (const Feature &query, std::vector<ImageID> *result) {
-            Poco::ScopedLock<Poco::Mutex> lock(mutex);
-            fbi::Plan plan;
+        // Reentrant: planning is read-only and the scanner uses pread.
+        // The bytes read are added atomically to *bytes if given.
+        void search (const Feature &query, std::vector<ImageID> *result, const volatile bool *stop = 0,
+                     uint64_t *bytes = 0) {
+            fbi::ScanStat st;
+            static thread_local fbi::Plan plan;    // reset by plan, keeps its selections
+            uint64_t t0 = fbi::ScanStat::now();
             db.plan(query.sketch, fbi::DB::SMART, SKETCH_PLAN_DIST, FBI_SKIP, &plan);
-            db.run(query.sketch, SKETCH_DIST, plan, result);
+            st.plan = fbi::ScanStat::now() - t0;
+            db.run(query.sketch, SKETCH_DIST, plan, result, stop, &st);
+            account(st);
+            if (bytes) {
+                __sync_fetch_and_add(bytes, st.bytes);
+            }
         }
 
-        void search (const std::vector<Feature> &query, std::vector<std::vector<ImageID> > *result) {
+        // Batches are serialized so that each disk has only one reader.
+        // See DB::batch for stops and bytes.
+        void search (const std::vector<Feature> &query, std::vector<std::vector<ImageID> > *result,
+                     const std::vector<const volatile bool *> *stops = 0,
+                     std::vector<uint64_t> *bytes = 0) {
             Poco::ScopedLock<Poco::Mutex> lock(mutex);
             std::vector<fbi::Chunk*> queries(query.size());
             for (unsigned i = 0; i < query.size(); ++i) {
                 queries[i] = const_cast<fbi::Chunk *>((const fbi::Chunk *)&(query[i].sketch[0]));
             }
-            db.batch(queries, fbi::DB::SMART, SKETCH_PLAN_DIST, SKETCH_DIST, FBI_SKIP, result);
+            fbi::ScanStat st;
+            db.batch(queries, fbi::DB::SMART, SKETCH_PLAN_DIST, SKETCH_DIST, FBI_SKIP, result, &st, stops, bytes);
+            if (!queries.empty()) account(st);
         }
 
         void stat (JSON &json) {
@@ -209,52 +391,94 @@ namespace nise {
     // query expansion
     class Expansion {
         Graph graph;
-
-        Expansion (const std::string &path): graph(path) {
+        // precomputed single-seed expansions, see index/graph-nibble.cpp
+        Graph cache;
+        // the images with more than RANDOM_MIN_DEGREE neighbors and a
+        // record, from which random results are drawn
+        std::vector<ImageID> eligible;
+
+        // xorshift64*, one generator per thread
+        static uint64_t next () {
+            static thread_local uint64_t state = 0;
+            if (state == 0) {
+                state = (uint64_t(Poco::Timestamp().epochMicroseconds()) * 0x9E3779B97F4A7C15ULL)
+                    ^ uint64_t(reinterpret_cast<uintptr_t>(&state)) ^ 1;
+            }
+            state ^= state >> 12;
+            state ^= state << 25;
+            state ^= state >> 27;
+            return state * 2685821657736338717ULL;
         }
 
-        ~Expansion () {
+        // uniform in [0, n)
+        static unsigned uniform (unsigned n) {
+            return unsigned(((next() >> 32) * n) >> 32);
         }
 
-        static Expansion *inst;
     public:
-        static void init (const Poco::Util::AbstractConfiguration &config)
-        {
-            BOOST_VERIFY(inst == NULL);
-            inst = new Expansion(config.getString("nise.expansion.db", ""));
-            Log::system().information("Expansion database started.");
-        }
-
-        static void cleanup () {
-            BOOST_VERIFY(inst != 0);
-            delete inst;
-            inst = 0;
-            Log::system().information("Expansion database stopped.");
+        // images: # images in the image DB, the graph may cover more
+        Expansion (const std::string &path, const std::string &cache_path, ImageID images)
+            : graph(path), cache(cache_path) {
+            ImageID n = std::min<ImageID>(graph.slots(), images);
+            for (ImageID v = 0; v < n; ++v) {
+                if (graph.degree(v) > RANDOM_MIN_DEGREE) eligible.push_back(v);
+            }
+            std::vector<ImageID>(eligible).swap(eligible);
         }
 
-        static Expansion &instance () {
-            return *inst;
+        ~Expansion () {
         }
 
         Graph::Range neighbors (ImageID v) const {
             return graph.get(v);
         }
 
+        // Faults in the adjacency of the given images.
+        void warm (const std::vector<ImageID> &ids) const {
+            ImageID sum = 0;
+            BOOST_FOREACH(ImageID v, ids) {
+                Graph::Range range = graph.get(v);
+                if (range.first < range.second) sum += range.first[0];
+                range = cache.get(v);
+                if (range.first < range.second) sum += range.first[0];
+            }
+            volatile ImageID sink = sum;
+            (void)sink;
+        }
+
         unsigned size () const {
             return graph.size();
         }
 
+        // A random image below max for the random page: any image if the
+        // graph covers few of them, otherwise a well connected one.
+        ImageID random (ImageID max) const {
+            if ((graph.size() * 10 < max) || eligible.empty()) {
+                return max ? uniform(max) : 0;
+            }
+            return eligible[uniform(eligible.size())];
+        }
+
+        // Expansion of a single image from the cache, false on a miss.
+        bool lookup (ImageID v, std::vector<ImageID> *result) const {
+            Graph::Range range = cache.get(v);
+            if (range.first == range.second) return false;
+            result->insert(result->end(), range.first, range.second);
+            return true;
+        }
+
         void apply (std::vector<ImageID> *result) const {
+            StageTimer timer(Metrics::instance().expansion);
             if (result->size() > MAX_INITIAL_RESULTS_FOR_EXPAND) {
                 return;
             }
             if (result->empty()) {
                 return;
             }
-            std::vector<ImageID> v;
-            swap(v, *result);
-            Nibble nibble(graph, NIBBLE_ALPHA, NIBBLE_EPSILON, NIBBLE_MAXIT);
-            nibble.nibble(v, result);
+            // scratch memory is reused by all the expansions of a thread
+            static thread_local Nibble::Scratch scratch;
+            Nibble nibble(graph, NIBBLE_ALPHA, NIBBLE_EPSILON, NIBBLE_MAXIT, &scratch);
+            nibble.nibble(result);
         }
 
     };
@@ -265,18 +489,63 @@ namespace nise {
         struct Page {
             std::string mime;
             std::string content;
+            std::string gzip;           // empty if not worth it
+            std::string etag;
+            std::string etag_gzip;      // the gzip variant is another entity
+            std::string modified;       // Last-Modified
+            Poco::Timestamp mtime;
+            bool immutable;             // versioned, cached for long
         };
     private:
         std::string root;
         bool preload;
+        std::set<std::string> immutable;
 
         typedef std::map<std::string, Poco::SharedPtr<Page> > PageMap;
         PageMap map;
+        Poco::FastMutex mutex;  // guards map when not preloaded
+
+        static bool compressible (const std::string &mime) {
+            return (mime.compare(0, 5, "text/") == 0)
+                || (mime == "application/json")
+                || (mime == "application/javascript");
+        }
+
+        Poco::SharedPtr<Page> load (const std::string &url, const Poco::File &file) const {
+            Poco::SharedPtr<Page> page = new Page;
+            ReadFile(file.path(), &page->content);
+            if (page->content.empty()) return 0;
+            page->mime = Extension2Mime::lookup(url);
+            page->mtime = file.getLastModified();
+            page->modified = Poco::DateTimeFormatter::format(page->mtime, Poco::DateTimeFormat::HTTP_FORMAT);
+            std::string checksum;
+            Checksum(page->content, &checksum);
+            page->etag = '"' + StringToHex(checksum).substr(0, 16) + '"';
+            page->etag_gzip = '"' + StringToHex(checksum).substr(0, 16) + "-gz\"";
+            page->immutable = immutable.count(url.substr(1)) > 0;
+            if (compressible(page->mime)) {
+                std::ostringstream ss(std::ios::binary);
+                {
+                    Poco::DeflatingOutputStream gz(ss, Poco::DeflatingStreamBuf::STREAM_GZIP, 9);
+                    gz.write(&page->content[0], page->content.size());
+                    gz.close();
+                }
+                if (ss.str().size() * 10 < page->content.size() * 9) {
+                    page->gzip = ss.str();
+                }
+            }
+            return page;
+        }
 
         StaticContent (const Poco::Util::AbstractConfiguration &config)
             : root(config.getString("nise.static.root")),
               preload(config.getBool("nise.static.preload")) 
         {
+            Poco::StringTokenizer tok(config.getString("nise.static.immutable", STATIC_IMMUTABLE_DEFAULT), ",",
+                                      Poco::StringTokenizer::TOK_IGNORE_EMPTY | Poco::StringTokenizer::TOK_TRIM);
+            for (Poco::StringTokenizer::Iterator it = tok.begin(); it != tok.end(); ++it) {
+                immutable.insert(*it);
+            }
             if (!preload) return;
             Poco::File dir(root);
             if (dir.isDirectory()) {
@@ -284,10 +553,10 @@ namespace nise {
                 while (it != end) {
                     Poco::File file(*it);
                     if (file.isFile()) {
-                        Poco::SharedPtr<Page> page = map["/" + it.name()]
-                                             = new Page;
-                        page->mime = Extension2Mime::lookup(it.name());
-                        ReadFile(file.path(), &page->content);
+                        Poco::SharedPtr<Page> page = load("/" + it.name(), file);
+                        if (!page.isNull()) {
+                            map["/" + it.name()] = page;
+                        }
                     }
                     ++it;
                 }
@@ -298,6 +567,37 @@ namespace nise {
         }
 
         static StaticContent *inst;
+
+        static bool acceptGzip (const Poco::Net::HTTPServerRequest &request) {
+            Poco::StringTokenizer tok(request.get("Accept-Encoding", ""), ",",
+                                      Poco::StringTokenizer::TOK_IGNORE_EMPTY | Poco::StringTokenizer::TOK_TRIM);
+            for (Poco::StringTokenizer::Iterator it = tok.begin(); it != tok.end(); ++it) {
+                const std::string &coding = *it;
+                if (coding.compare(0, 4, "gzip") != 0) continue;
+                // "gzip;q=0" refuses it
+                size_t q = coding.find("q=");
+                if (q == coding.npos) return true;
+                return std::atof(coding.c_str() + q + 2) > 0;
+            }
+            return false;
+        }
+
+        static bool notModified (const Page &page, const std::string &etag, const Poco::Net::HTTPServerRequest &request) {
+            if (request.has("If-None-Match")) {
+                const std::string &match = request.get("If-None-Match");
+                return (match == "*") || (match.find(etag) != match.npos);
+            }
+            if (request.has("If-Modified-Since")) {
+                Poco::DateTime since;
+                int tz;
+                if (Poco::DateTimeParser::tryParse(Poco::DateTimeFormat::HTTP_FORMAT,
+                            request.get("If-Modified-Since"), since, tz)) {
+                    // HTTP dates have a resolution of seconds
+                    return page.mtime.epochTime() <= since.timestamp().epochTime();
+                }
+            }
+            return false;
+        }
    public:
 
         static void init (const Poco::Util::AbstractConfiguration &config) {
@@ -317,6 +617,7 @@ namespace nise {
             return *inst;
         }
 
+        // Without preloading, a file is only read again when it changes.
         Poco::SharedPtr<Page> get (const std::string &url) {
             if (preload) {
                 PageMap::const_iterator it = map.find(url);
@@ -324,16 +625,55 @@ namespace nise {
                 return it->second;
             }
             else {
-                std::string content;
-                ReadFile(root + url, &content);
-                if (!content.size()) return 0;
-                else {
-                    Page *page = new Page;
-                    page->mime = Extension2Mime::lookup(url);
-                    page->content.swap(content);
-                    return page;
+                if (url.find("..") != url.npos) return 0;
+                Poco::File file(root + url);
+                if (!file.exists() || !file.isFile()) return 0;
+                Poco::Timestamp mtime = file.getLastModified();
+                {
+                    Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+                    PageMap::const_iterator it = map.find(url);
+                    if ((it != map.end()) && (it->second->mtime == mtime)) {
+                        return it->second;
+                    }
                 }
+                Poco::SharedPtr<Page> page = load(url, file);
+                if (page.isNull()) return 0;
+                Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+                map[url] = page;
+                return page;
+            }
+        }
+
+        static void serve (const Page &page,
+                           Poco::Net::HTTPServerRequest &request,
+                           Poco::Net::HTTPServerResponse &response) {
+            bool gzip = !page.gzip.empty() && acceptGzip(request);
+            const std::string &etag = gzip ? page.etag_gzip : page.etag;
+            response.set("ETag", etag);
+            response.set("Last-Modified", page.modified);
+            if (page.immutable) {
+                response.set("Cache-Control", "public, max-age=" + boost::lexical_cast<std::string>(STATIC_MAX_AGE));
+            }
+            else {
+                response.set("Cache-Control", "no-cache");
+            }
+            if (!page.gzip.empty()) {
+                response.set("Vary", "Accept-Encoding");
+            }
+            if (notModified(page, etag, request)) {
+                response.setStatus(Poco::Net::HTTPResponse::HTTP_NOT_MODIFIED);
+                response.setContentLength(0);
+                response.send();
+                return;
             }
+            response.setContentType(page.mime);
+            const std::string *body = &page.content;
+            if (gzip) {
+                response.set("Content-Encoding", "gzip");
+                body = &page.gzip;
+            }
+            response.setContentLength(body->size());
+            response.sendBuffer(body->data(), body->size());
         }
     };
 
@@ -380,35 +720,56 @@ namespace nise {
     };
 
     class ImageDB{
+        typedef std::vector<std::pair<ImageID, Poco::SharedPtr<Record> > > Container;
+
         std::vector<uint64_t> index;
         std::ifstream input;
+        std::ifstream background;   // of prefetch, read without the mutex
 
+        unsigned capacity;
         Poco::LRUCache<ImageID, Record> cache;
 
         uint32_t total;
 
         Poco::Mutex mutex;
+        Poco::FastMutex reading;    // protects background
 
-        void load (ImageID id) {
-            uint32_t g_id = ContainerID(id);
+        void read (std::istream &is, uint32_t g_id, Container *container) const {
+            container->clear();
             if (g_id >= index.size()) return;
-            input.seekg(index[g_id]);
-            Signature::CONTAINER.check(input);
-            BOOST_VERIFY(input);
-            uint32_t c_id = ReadUint32(input);
-            /*uint32_t size =*/ ReadUint32(input);
-            uint32_t cnt = ReadUint32(input);
+            is.seekg(index[g_id]);
+            Signature::CONTAINER.check(is);
+            BOOST_VERIFY(is);
+            uint32_t c_id = ReadUint32(is);
+            /*uint32_t size =*/ ReadUint32(is);
+            uint32_t cnt = ReadUint32(is);
             BOOST_VERIFY(g_id == c_id);
             for (unsigned i = 0; i < cnt; ++i) {
-                ImageID id = ReadUint32(input);
-                Record *record = new Record;
-                record->readFields(input);
-                cache.add(id, record);
+                ImageID id = ReadUint32(is);
+                Poco::SharedPtr<Record> record = new Record;
+                record->readFields(is);
+                container->push_back(std::make_pair(id, record));
             }
         }
 
+        // Called with the mutex held.
+        void add (const Container &container) {
+            for (unsigned i = 0; i < container.size(); ++i) {
+                cache.add(container[i].first, container[i].second);
+            }
+        }
+
+        // Called with the mutex held.
+        void load (ImageID id) {
+            Container container;
+            read(input, ContainerID(id), &container);
+            add(container);
+        }
+
+    public:
         ImageDB (const Poco::Util::AbstractConfiguration &config)
-            : cache(config.getInt("nise.image.cache", RECORD_CACHE_DEFAULT))
+            : capacity(config.getInt("nise.image.cache", RECORD_CACHE_DEFAULT)),
+              cache(capacity)
         {
             std::string index_path = config.getString("nise.image.index");
             std::string file = config.getString("nise.image.db");
@@ -425,39 +786,22 @@ namespace nise {
             BOOST_VERIFY(is);
             // input data file
             input.open(file.c_str(), std::ios::binary);
+            background.open(file.c_str(), std::ios::binary);
             total = (index.size() - 1) * CONTAINER_SIZE;
         }
 
         ~ImageDB () {
         }
 
-        static ImageDB *inst;
-    public:
-
-        static void init (const Poco::Util::AbstractConfiguration &config) {
-            BOOST_VERIFY(inst == 0);
-            inst = new ImageDB(config);
-            Log::system().information("Image database started.");
-        }
-
-        static void cleanup (void) {
-            BOOST_VERIFY(inst != 0);
-            delete inst;
-            inst = 0;
-            Log::system().information("Image database stopped.");
-        }
-
-        static ImageDB &instance () {
-            return *inst;
-        }
-
         Poco::SharedPtr<Record> get (ImageID id, bool *hit) {
             Poco::ScopedLock<Poco::Mutex> lock(mutex);
             Poco::SharedPtr<Record> ptr = cache.get(id);
             if (!ptr.isNull()) {
+                Metrics::instance().image_hit.add();
                 *hit = true;
                 return ptr;
             }
+            Metrics::instance().image_miss.add();
             load(id);
             *hit = false;
             return cache.get(id);
@@ -466,202 +810,1755 @@ namespace nise {
         uint32_t size() const {
             return total;
         }
-    };
 
-    class Retrieval {
-        Record record;
-        std::vector<std::vector<ImageID> > results;
-        unsigned next;
-        Poco::Mutex mutex;
+        // the images in the record cache
+        void hot (std::vector<ImageID> *ids) {
+            Poco::ScopedLock<Poco::Mutex> lock(mutex);
+            std::set<ImageID> keys = cache.getAllKeys();
+            ids->assign(keys.begin(), keys.end());
+        }
+
+        // Loads the containers of the given images that are not cached,
+        // at most what fills half of the cache, so that a prefetch does
+        // not evict the pages being looked at.  Containers are read
+        // without the mutex, which is only taken to check and fill the
+        // cache, so get is not held up by the disk.  Returns the #
+        // containers loaded.
+        unsigned prefetch (std::vector<ImageID> ids) {
+            std::sort(ids.begin(), ids.end());
+            unsigned max = std::max(1U, capacity / CONTAINER_SIZE / 2);
+            unsigned loaded = 0;
+            uint32_t last = uint32_t(-1);
+            Container container;
+            BOOST_FOREACH(ImageID id, ids) {
+                if (loaded >= max) break;
+                if (ContainerID(id) == last) continue;
+                {
+                    Poco::ScopedLock<Poco::Mutex> lock(mutex);
+                    if (cache.has(id)) continue;
+                }
+                last = ContainerID(id);
+                {
+                    Poco::ScopedLock<Poco::FastMutex> lock(reading);
+                    read(background, last, &container);
+                }
+                Poco::ScopedLock<Poco::Mutex> lock(mutex);
+                add(container);
+                ++loaded;
+            }
+            return loaded;
+        }
 
-        Retrieval () {
+        // Loads the containers of the given images into the record cache.
+        void warm (const std::vector<ImageID> &ids) {
+            uint32_t last = uint32_t(-1);
+            BOOST_FOREACH(ImageID id, ids) {   // sorted, see hot
+                if (ContainerID(id) == last) continue;
+                last = ContainerID(id);
+                Poco::ScopedLock<Poco::Mutex> lock(mutex);
+                if (!cache.has(id)) load(id);
+            }
         }
+    };
+
+    // The indexes searched by the server.  A reload builds a new
+    // generation in the background and swaps it in atomically.  Sessions
+    // and retrievals hold on to the generation they started with, so a
+    // search in flight finishes on the old indexes, which are released
+    // with their last user.
+    class Generation {
     public:
+        typedef Poco::SharedPtr<Generation> Ptr;
+    private:
+        unsigned serial;
+        uint64_t fingerprint;
+        ImageDB image;
+        SketchDB sketch;
+        Expansion expansion;
+        ClusterMap clusters;
+
+        static Ptr current;
+        // replaced generations, by serial, until nothing else holds them
+        static std::map<unsigned, Ptr> previous;
+        static Poco::FastMutex mutex;   // protects current & previous
+        static Poco::Mutex loading;     // one reload at a time
+        static int alive;
+
+        // Moves the replaced generations no longer used elsewhere to
+        // *released, to be destroyed outside the lock.  With the mutex.
+        static void prune (std::vector<Ptr> *released) {
+            std::map<unsigned, Ptr>::iterator it = previous.begin();
+            while (it != previous.end()) {
+                if (it->second.referenceCount() == 1) {
+                    released->push_back(it->second);
+                    previous.erase(it++);
+                }
+                else ++it;
+            }
+        }
 
-        static Retrieval *fromRecord (Record &record) {
-            Retrieval *r = new Retrieval;
-            r->record.swap(record);
-            r->results.resize(r->record.features.size());
-            r->next = 0;
-            return r;
+        static void check (const std::string &path) {
+            if (!path.empty() && !Poco::File(path).exists()) {
+                throw Poco::FileNotFoundException(path);
+            }
         }
 
-        ~Retrieval () {
+        // FNV-1a of the names, sizes and times of the index files, which
+        // identifies a build of the indexes across restarts
+        static uint64_t identify (const Poco::Util::AbstractConfiguration &config) {
+            const char *keys[] = {"nise.sketch.db", "nise.image.index", "nise.image.db"};
+            uint64_t h = 14695981039346656037ULL;
+            for (unsigned i = 0; i < sizeof(keys) / sizeof(keys[0]); ++i) {
+                Poco::File file(config.getString(keys[i]));
+                std::string id = file.path() + ':'
+                    + boost::lexical_cast<std::string>(file.getSize()) + ':'
+                    + boost::lexical_cast<std::string>(file.getLastModified().epochMicroseconds());
+                BOOST_FOREACH(char c, id) {
+                    h = (h ^ (unsigned char)c) * 1099511628211ULL;
+                }
+            }
+            return h;
         }
 
-        unsigned size () const {
-            return record.features.size();
+        Generation (const Poco::Util::AbstractConfiguration &config, unsigned serial_)
+            : serial(serial_),
+            fingerprint(identify(config)),
+            image(config),
+            sketch(config.getString("nise.sketch.db")),
+            expansion(config.getString("nise.expansion.db", ""),
+                      config.getString("nise.expansion.cache", ""),
+                      image.size()),
+            clusters(config.getString("nise.cluster.db", "")) {
+            __sync_fetch_and_add(&alive, 1);
         }
 
-        bool done () const {
-            return next >= record.features.size();
+    public:
+        ~Generation () {
+            __sync_fetch_and_sub(&alive, 1);
+            Log::system().information("Index generation "
+                    + boost::lexical_cast<std::string>(serial) + " released.");
         }
 
-        unsigned finished () const {
-            return next;
+        static void init (const Poco::Util::AbstractConfiguration &config) {
+            BOOST_VERIFY(current.isNull());
+            current = new Generation(config, 0);
+            Log::system().information("Index generation 0 started.");
         }
 
-        const std::vector<ImageID> &last () const {
-            BOOST_VERIFY(results.size() > 0);
-            return results.back();
+        static void cleanup (void) {
+            BOOST_VERIFY(!current.isNull());
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            previous.clear();
+            current = 0;
+        }
+
+        // the generation new searches should use
+        static Ptr get () {
+            std::vector<Ptr> released;
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            if (!previous.empty()) prune(&released);
+            return current;
+        }
+
+        // The generation with the given serial, as long as it is current
+        // or still used by a session; null once released.  Image ids are
+        // only meaningful within a generation, so requests about the
+        // results of a search carry the serial of its generation.
+        static Ptr find (unsigned serial) {
+            std::vector<Ptr> released;
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            if (!previous.empty()) prune(&released);
+            if (current->serial == serial) return current;
+            std::map<unsigned, Ptr>::const_iterator it = previous.find(serial);
+            if (it == previous.end()) return 0;
+            return it->second;
+        }
+
+        // Loads the indexes named by config as a new generation, warms it
+        // with the images hot in the current one and the given queries,
+        // and swaps it in.  Returns the serial of the new generation.
+        static unsigned reload (const Poco::Util::AbstractConfiguration &config,
+                                const std::vector<Feature> &queries) {
+            Poco::ScopedLock<Poco::Mutex> lock(loading);
+            check(config.getString("nise.image.index"));
+            check(config.getString("nise.image.db"));
+            check(config.getString("nise.sketch.db"));
+            check(config.getString("nise.expansion.db", ""));
+            check(config.getString("nise.expansion.cache", ""));
+            check(config.getString("nise.cluster.db", ""));
+
+            Ptr old = get();
+            Ptr next = new Generation(config, old->serial + 1);
+
+            std::vector<ImageID> ids;
+            old->image.hot(&ids);
+            next->image.warm(ids);
+            next->expansion.warm(ids);
+            if (!queries.empty()) {
+                std::vector<std::vector<ImageID> > found;
+                next->sketch.search(queries, &found);
+            }
+
+            {
+                Poco::ScopedLock<Poco::FastMutex> l(mutex);
+                previous[old->serial] = old;
+                current = next;
+            }
+            old = 0;
+            Log::system().information("Index generation "
+                    + boost::lexical_cast<std::string>(next->serial) + " started, "
+                    + boost::lexical_cast<std::string>(ids.size()) + " images and "
+                    + boost::lexical_cast<std::string>(queries.size()) + " queries warmed.");
+            return next->serial;
         }
 
-        const std::vector<ImageID> &get (unsigned idx) const {
-            BOOST_VERIFY(idx < results.size());
-            return results[idx];
+        // # generations in memory, more than one while old searches drain
+        static int getAlive () {
+            return alive;
         }
 
-        Poco::Mutex &getMutex () {
-            return mutex;
+        unsigned getSerial () const {
+            return serial;
         }
 
-        void batch () {
-            if (done()) return;
-            SketchDB::instance().search(record.features, &results);
-            next = record.features.size();
+        uint64_t getFingerprint () const {
+            return fingerprint;
         }
 
-        void progress () {
-            //Poco::ScopedLock<Poco::Mutex> lock(mutex);
-            if (done()) return;
-            SketchDB::instance().search(record.features[next], &results[next]);
-            ++next;
+        ImageDB &getImageDB () {
+            return image;
         }
 
-        const Record &getRecord() const {
-            return record;
+        SketchDB &getSketchDB () {
+            return sketch;
+        }
+
+        const Expansion &getExpansion () const {
+            return expansion;
+        }
+
+        // empty if not configured
+        const ClusterMap &getClusters () const {
+            return clusters;
         }
     };
 
-    class RetrievalCache: public Poco::LRUCache<std::string, Retrieval> {
+    // Loads the records a client is likely to ask for next, those of the
+    // page of results just served and of the next page, whose thumbnails
+    // and meta data the browser fetches right away.  The containers are
+    // read on a low priority thread, grouped by ContainerID, into the
+    // ImageDB of the generation that produced the results.  Requests are
+    // dropped when nise.image.prefetch.queue are already waiting.
+    class BackgroundFetcher: public Poco::Runnable {
+        struct Request {
+            Generation::Ptr generation;
+            std::vector<ImageID> ids;
+        };
+
+        std::deque<Request> queue;
+        unsigned capacity;
+        Poco::FastMutex mutex;
+        Poco::Event event;
+        bool done;
+        Poco::Thread thread;
+
+        static BackgroundFetcher *inst;
+
+        BackgroundFetcher (unsigned capacity_): capacity(capacity_), done(false) {
+            thread.setPriority(Poco::Thread::PRIO_LOWEST);
+            thread.start(*this);
+        }
+
+        // Requests still queued are dropped.
+        ~BackgroundFetcher () {
+            done = true;
+            event.set();
+            thread.join();
+        }
 
-        static Poco::LRUCache<std::string, Retrieval> *inst;
     public:
         static void init (const Poco::Util::AbstractConfiguration &config) {
             BOOST_VERIFY(inst == 0);
-            inst = new Poco::LRUCache<std::string, Retrieval>(config.getInt("nise.retrieval.cache",
-                                                                RETRIEVAL_CACHE_DEFAULT));
-            Log::system().information("Retrieval cache started.");
+            if (config.getBool("nise.image.prefetch", true)) {
+                inst = new BackgroundFetcher(config.getInt("nise.image.prefetch.queue", PREFETCH_QUEUE_DEFAULT));
+            }
         }
 
         static void cleanup (void) {
-            BOOST_VERIFY(inst != 0);
+            if (inst == 0) return;
             delete inst;
             inst = 0;
-            Log::system().information("Retrieval cache stopped.");
         }
 
-        static Poco::LRUCache<std::string, Retrieval> &instance () {
-            return *inst;
+        // NULL if prefetching is disabled.
+        static BackgroundFetcher *instance () {
+            return inst;
+        }
+
+        void prefetch (const Generation::Ptr &generation, const ImageID *first, const ImageID *last) {
+            if (first == last) return;
+            {
+                Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+                if (queue.size() >= capacity) {
+                    Metrics::instance().prefetch_dropped.add();
+                    return;
+                }
+                queue.push_back(Request());
+                queue.back().generation = generation;
+                queue.back().ids.assign(first, last);
+            }
+            event.set();
         }
 
+        void run () {
+            Log::system().information("Background fetcher started.");
+            while (!done) {
+                Request req;
+                {
+                    Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+                    if (!queue.empty()) {
+                        req = queue.front();
+                        queue.pop_front();
+                    }
+                }
+                if (req.generation.isNull()) {
+                    event.wait();
+                    continue;
+                }
+                unsigned loaded = req.generation->getImageDB().prefetch(req.ids);
+                Metrics::instance().prefetch_loaded.add(loaded);
+            }
+            Log::system().information("Background fetcher stopped.");
+        }
     };
 
-    class Session {
+    // Collects the feature queries of all active retrievals and runs them
+    // through DB::batch together, so that the I/O of concurrent queries is
+    // sorted and coalesced.  While few queries overlap a request is
+    // dispatched as soon as the scheduler is free; under load it waits up
+    // to a window for the batch to fill up.
+    class BatchScheduler: public Poco::Runnable {
     public:
-        enum Type {
-            RANDOM = 0,
-            LOCAL = 1,
-            IMAGE = 2
+        class Client {
+        public:
+            virtual ~Client () {
+            }
+            // Called from the scheduler thread when a query returns.
+            // ok is false if the query was dropped because of stop.
+            virtual void finish (unsigned tag, bool ok) = 0;
         };
 
-        struct Parameter {
-            bool expansion;
-            bool batch;
-            Box box;
-            bool crop;
+        // Requests on different generations are never batched together.
+        struct Request {
+            SketchDB *db;
+            const Feature *query;
+            std::vector<ImageID> *result;
+            const volatile bool *stop;
+            uint64_t *bytes;        // bytes read are added atomically
+            Client *client;
+            unsigned tag;
         };
 
     private:
-
-        Poco::UUID id;
-
-        Type method;
-
-        ImageID local;
-        Poco::SharedPtr<Retrieval> retrieval;
-
-        Parameter param;
-
+        unsigned window;    // miliseconds
+        unsigned max_batch;
+        float load;         // moving average of # clients per batch
         bool done;
-        unsigned empty;
-        unsigned finished;
-
-        std::set<ImageID> seen;
-        std::vector<ImageID> results;
-
-        float time;
-        // A session can be accessed and manipulated by one thread
-        Poco::Mutex mutex;
+        std::deque<Request> queue;
+        Poco::FastMutex mutex;
+        Poco::Event event;
+        Poco::Thread thread;
 
-        static Poco::UUIDGenerator uuid;
+        BatchScheduler (unsigned window_, unsigned max_batch_)
+            : window(window_), max_batch(max_batch_), load(0), done(false) {
+            thread.start(*this);
+        }
 
-        void sync () {
-            poco_check_ptr(retrieval);
-            const Record &record = retrieval->getRecord();
-            poco_assert(record.regions.size() == record.features.size());
-            while (finished < retrieval->finished()) {
-                if (retrieval->get(finished).empty()) {
-                    ++empty;
+        ~BatchScheduler () {
+            {
+                Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+                done = true;
+            }
+            event.set();
+            thread.join();
+        }
+
+        static BatchScheduler *inst;
+
+        // A request whose stop flag is raised during the scan is dropped
+        // there, so that its client is not held up by the others.
+        void dispatch (const std::vector<Request> &batch) {
+            std::vector<Feature> queries;
+            std::vector<const volatile bool *> stops;
+            std::vector<unsigned> live;
+            std::set<Client *> clients;
+            for (unsigned i = 0; i < batch.size(); ++i) {
+                const Request &req = batch[i];
+                if (req.stop && *req.stop) {
+                    req.client->finish(req.tag, false);
                 }
                 else {
-                    const Region &region = record.regions[finished];
-
+                    live.push_back(i);
+                    queries.push_back(*req.query);
+                    stops.push_back(req.stop);
+                    clients.insert(req.client);
+                }
+            }
+            if (queries.empty()) return;
+            load = load * 0.9F + clients.size() * 0.1F;
+            std::vector<std::vector<ImageID> > results;
+            std::vector<uint64_t> bytes;
+            batch.front().db->search(queries, &results, &stops, &bytes);
+            for (unsigned i = 0; i < live.size(); ++i) {
+                const Request &req = batch[live[i]];
+                if (req.bytes) {
+                    __sync_fetch_and_add(req.bytes, bytes[i]);
+                }
+                // the scan might be partial if stopped
+                if (req.stop && *req.stop) {
+                    req.client->finish(req.tag, false);
+                    continue;
+                }
+                req.result->swap(results[i]);
+                req.client->finish(req.tag, true);
+            }
+        }
+
+    public:
+        static void init (const Poco::Util::AbstractConfiguration &config) {
+            BOOST_VERIFY(inst == 0);
+            int window = config.getInt("nise.search.batch.window", 0);
+            if (window > 0) {
+                inst = new BatchScheduler(window, config.getInt("nise.search.batch.size",
+                                                                BATCH_SIZE_DEFAULT));
+                Log::system().information("Batch scheduler started.");
+            }
+        }
+
+        static void cleanup (void) {
+            if (inst == 0) return;
+            delete inst;
+            inst = 0;
+            Log::system().information("Batch scheduler stopped.");
+        }
+
+        // NULL if cross-request batching is disabled.
+        static BatchScheduler *instance () {
+            return inst;
+        }
+
+        // # queued requests
+        unsigned pending () {
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            return queue.size();
+        }
+
+        void submit (const std::vector<Request> &requests) {
+            {
+                Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+                queue.insert(queue.end(), requests.begin(), requests.end());
+            }
+            event.set();
+        }
+
+        void run () {
+            for (;;) {
+                {
+                    Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+                    if (done && queue.empty()) break;
+                }
+                if (pending() == 0) {
+                    event.wait();
+                    continue;
+                }
+                if (load > 1.5F) {
+                    Timer timer(window);
+                    while ((pending() < max_batch) && !timer.timeout()) {
+                        event.tryWait(1);
+                    }
+                }
+                std::vector<Request> batch;
+                {
+                    Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+                    SketchDB *db = queue.front().db;
+                    std::deque<Request>::iterator it = queue.begin();
+                    while ((it != queue.end()) && (batch.size() < max_batch)) {
+                        if (it->db == db) {
+                            batch.push_back(*it);
+                            it = queue.erase(it);
+                        }
+                        else ++it;
+                    }
+                }
+                dispatch(batch);
+            }
+        }
+    };
+
+    // worker threads for searching the features of a query in parallel
+    class SearchPool {
+        static TaskPool *inst;
+    public:
+        static void init (const Poco::Util::AbstractConfiguration &config) {
+            BOOST_VERIFY(inst == 0);
+            int threads = config.getInt("nise.search.threads",
+                                        Poco::Environment::processorCount());
+            if (threads > 0) {
+                inst = new TaskPool(threads);
+                Log::system().information("Search pool started.");
+            }
+        }
+
+        static void cleanup (void) {
+            if (inst == 0) return;
+            delete inst;
+            inst = 0;
+            Log::system().information("Search pool stopped.");
+        }
+
+        // NULL if features are to be searched on the calling thread.
+        static TaskPool *instance () {
+            return inst;
+        }
+    };
+
+    // Extracts query images on a few dedicated threads, so that uploads
+    // and downloads do not hold the HTTP threads busy with decoding, SIFT
+    // and sketching while thumbnails and follow-ups wait.  The queue is
+    // bounded, interactive queries go before those of batch clients, and
+    // a query that has not started within nise.extract.deadline
+    // miliseconds is dropped.  A started job is waited for at most
+    // nise.extract.timeout miliseconds.
+    class ExtractionPool {
+        struct Job {
+            enum State {
+                QUEUED = 0,
+                RUNNING,
+                DONE,
+                EXPIRED,
+                FAILED
+            };
+            std::string image;
+            Record record;
+            std::string error;  // if FAILED
+            Poco::Timestamp queued;
+            State state;        // protected by the pool mutex
+            Poco::Event done;
+        };
+    public:
+        typedef Poco::SharedPtr<Job> JobPtr;
+    private:
+
+        struct Worker: public Poco::Runnable {
+            ExtractionPool *pool;
+            Poco::Thread thread;
+
+            void run () {
+                pool->work();
+            }
+        };
+
+        std::deque<JobPtr> interactive;
+        std::deque<JobPtr> batch;
+        unsigned capacity;
+        unsigned deadline;      // miliseconds
+        unsigned timeout;       // miliseconds
+        Poco::FastMutex mutex;
+        // one permit per queued job, plus one per worker on shutdown
+        Poco::Semaphore permits;
+        std::vector<Worker *> workers;
+
+        static ExtractionPool *inst;
+
+        ExtractionPool (unsigned threads, unsigned capacity_, unsigned deadline_, unsigned timeout_)
+            : capacity(capacity_), deadline(deadline_), timeout(timeout_), permits(0, INT_MAX) {
+            workers.resize(threads);
+            BOOST_FOREACH(Worker *&w, workers) {
+                w = new Worker;
+                w->pool = this;
+                w->thread.start(*w);
+            }
+        }
+
+        // Queued jobs are still run before the workers exit.
+        ~ExtractionPool () {
+            for (unsigned i = 0; i < workers.size(); ++i) {
+                permits.set();
+            }
+            BOOST_FOREACH(Worker *w, workers) {
+                w->thread.join();
+                delete w;
+            }
+        }
+
+        void work () {
+            for (;;) {
+                permits.wait();
+                JobPtr job;
+                {
+                    Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+                    std::deque<JobPtr> &queue = interactive.empty() ? batch : interactive;
+                    if (queue.empty()) break;   // only happens on shutdown
+                    job = queue.front();
+                    queue.pop_front();
+                    if (job->state != Job::QUEUED) continue;    // given up by the client
+                    if (job->queued.isElapsed(Poco::Timestamp::TimeDiff(deadline) * 1000)) {
+                        job->state = Job::EXPIRED;
+                        Metrics::instance().extract_expired.add();
+                        job->done.set();
+                        continue;
+                    }
+                    job->state = Job::RUNNING;
+                }
+                Metrics::instance().extract_wait.add(job->queued.elapsed());
+                Job::State state = Job::DONE;
+                try {
+                    Extractor::local().extract(job->image, &job->record, true);
+                }
+                catch (const std::exception &e) {
+                    state = Job::FAILED;
+                    job->error = e.what();
+                    Metrics::instance().extract_failed.add();
+                }
+                {
+                    Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+                    job->state = state;
+                }
+                job->done.set();
+            }
+        }
+
+    public:
+        static void init (const Poco::Util::AbstractConfiguration &config) {
+            BOOST_VERIFY(inst == 0);
+            int threads = config.getInt("nise.extract.threads",
+                                        Poco::Environment::processorCount());
+            if (threads > 0) {
+                inst = new ExtractionPool(threads,
+                        config.getInt("nise.extract.queue", EXTRACT_QUEUE_DEFAULT),
+                        config.getInt("nise.extract.deadline", EXTRACT_DEADLINE_DEFAULT),
+                        config.getInt("nise.extract.timeout", EXTRACT_TIMEOUT_DEFAULT));
+                Log::system().information("Extraction pool started.");
+            }
+        }
+
+        static void cleanup (void) {
+            if (inst == 0) return;
+            delete inst;
+            inst = 0;
+            Log::system().information("Extraction pool stopped.");
+        }
+
+        // NULL if queries are extracted on the HTTP threads.
+        static ExtractionPool *instance () {
+            return inst;
+        }
+
+        // # queued jobs, including those given up but not yet removed
+        unsigned pending () {
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            return interactive.size() + batch.size();
+        }
+
+        // Queues the extraction of a query image, taken from *image, and
+        // returns at once; null if the queue is full.
+        JobPtr submit (std::string *image, bool interactive_) {
+            JobPtr job = new Job;
+            job->state = Job::QUEUED;
+            {
+                Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+                if (interactive.size() + batch.size() >= capacity) {
+                    Metrics::instance().extract_rejected.add();
+                    return 0;
+                }
+                job->image.swap(*image);
+                (interactive_ ? interactive : batch).push_back(job);
+            }
+            permits.set();
+            return job;
+        }
+
+        // Gives up a submitted job if it has not started.
+        void cancel (const JobPtr &job) {
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            if (job->state == Job::QUEUED) job->state = Job::EXPIRED;
+        }
+
+        // Extracts a query image on the pool and waits for it.  False if
+        // the queue is full, the job did not start before the deadline or
+        // did not finish in time; throws if the extraction failed.
+        bool extract (const std::string &image, Record *record, bool interactive_) {
+            std::string copy(image);
+            JobPtr job = submit(&copy, interactive_);
+            if (job.isNull()) return false;
+            return wait(job, record);
+        }
+
+        // Waits for a job from submit, see extract.  The deadline counts
+        // from submission.
+        bool wait (const JobPtr &job, Record *record) {
+            Poco::Timestamp::TimeDiff left = Poco::Timestamp::TimeDiff(deadline) * 1000 - job->queued.elapsed();
+            if (!job->done.tryWait(std::max<long>(0, long(left / 1000)))) {
+                {
+                    Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+                    if (job->state == Job::QUEUED) {
+                        job->state = Job::EXPIRED;
+                        Metrics::instance().extract_expired.add();
+                        return false;
+                    }
+                }
+                // started in time, let it finish; if it does not, the
+                // worker still holds the job and drops it when done
+                if (!job->done.tryWait(timeout)) {
+                    Metrics::instance().extract_timeout.add();
+                    return false;
+                }
+            }
+            Job::State state;
+            {
+                Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+                state = job->state;
+            }
+            if (state == Job::FAILED) {
+                throw Poco::RuntimeException("extraction failed: " + job->error);
+            }
+            if (state != Job::DONE) return false;
+            record->swap(job->record);
+            return true;
+        }
+    };
+
+    // Features are searched either one by one on the calling thread
+    // (progress), all together with DB::batch (batch), or concurrently on
+    // a TaskPool or a BatchScheduler (schedule/wait/cancel).  In all cases
+    // the results are published per feature, in the order they are
+    // finished.
+    class Retrieval: private BatchScheduler::Client {
+        enum State {
+            PENDING = 0,
+            RUNNING,
+            FINISHED
+        };
+
+        class Task: public TaskPool::Task {
+            Retrieval *owner;
+            unsigned index;
+        public:
+            Task (Retrieval *o, unsigned i): owner(o), index(i) {
+            }
+            void run () {
+                owner->runTask(index);
+            }
+        };
+
+        Generation::Ptr generation;
+        Record record;
+        std::vector<std::vector<ImageID> > results;
+        std::vector<State> state;
+        std::vector<unsigned> order;    // features in the order finished
+        unsigned next;                  // all before next are not pending
+        unsigned running;
+        unsigned stored;                // # finished at the last saved checkpoint
+        uint64_t scanned;               // bytes read from the sketch DB
+        bool accounted;                 // scanned is in the metrics
+        volatile bool stop;
+        Poco::FastMutex lock;           // protects state, order & running
+        Poco::Event event;              // set, under lock, whenever a task returns
+        Poco::Mutex mutex;
+
+        Retrieval (): next(0), running(0), stored(0), scanned(0), accounted(false), stop(false) {
+        }
+
+        // one sample per query, when all its features are found or when
+        // it is dropped before that
+        void account () {
+            if (accounted) return;
+            accounted = true;
+            Metrics::instance().scan_bytes.add(scanned);
+        }
+
+        void publish (unsigned idx) {
+            state[idx] = FINISHED;
+            order.push_back(idx);
+            if (order.size() == state.size()) account();
+        }
+
+        void finish (unsigned idx, bool ok) {
+            {
+                Poco::ScopedLock<Poco::FastMutex> l(lock);
+                if (ok) {
+                    publish(idx);
+                }
+                else {
+                    results[idx].clear();
+                    state[idx] = PENDING;
+                    if (idx < next) next = idx;
+                }
+                --running;
+                // under the lock: cancel may free us once running is 0
+                event.set();
+            }
+        }
+
+        void runTask (unsigned idx) {
+            if (!stop) {
+                generation->getSketchDB().search(record.features[idx], &results[idx], &stop, &scanned);
+            }
+            // the scan might be partial if stopped, redo it next time
+            finish(idx, !stop);
+        }
+
+        // marks the pending features before limit as running
+        void claim (unsigned limit, std::vector<unsigned> *todo) {
+            Poco::ScopedLock<Poco::FastMutex> l(lock);
+            stop = false;
+            limit = std::min<unsigned>(limit, state.size());
+            for (unsigned i = next; i < limit; ++i) {
+                if (state[i] == PENDING) {
+                    state[i] = RUNNING;
+                    todo->push_back(i);
+                }
+            }
+            next = std::max(next, limit);
+            running += todo->size();
+        }
+
+    public:
+
+        static Retrieval *fromRecord (Record &record, const Generation::Ptr &generation) {
+            Retrieval *r = new Retrieval;
+            r->generation = generation;
+            r->record.swap(record);
+            r->results.resize(r->record.features.size());
+            r->state.resize(r->record.features.size(), PENDING);
+            r->order.reserve(r->record.features.size());
+            return r;
+        }
+
+        ~Retrieval () {
+            BOOST_VERIFY(running == 0);
+            account();
+        }
+
+        // Sets the result of a feature found earlier, see RetrievalStore.
+        // Only before the retrieval is shared.
+        void restore (unsigned idx, std::vector<ImageID> *found) {
+            if ((idx >= state.size()) || (state[idx] != PENDING)) return;
+            results[idx].swap(*found);
+            publish(idx);
+            ++stored;
+            while ((next < state.size()) && (state[next] != PENDING)) ++next;
+        }
+
+        // All the finished features in *finished if some have finished
+        // since the last saved checkpoint; false if none have.
+        bool checkpoint (std::vector<unsigned> *finished) {
+            Poco::ScopedLock<Poco::FastMutex> l(lock);
+            if (order.size() == stored) return false;
+            finished->assign(order.begin(), order.end());
+            return true;
+        }
+
+        // The first n finished features have been saved.
+        void commit (unsigned n) {
+            Poco::ScopedLock<Poco::FastMutex> l(lock);
+            stored = std::max(stored, n);
+        }
+
+        unsigned size () const {
+            return record.features.size();
+        }
+
+        // whether the features before limit are all finished
+        bool done (unsigned limit) {
+            Poco::ScopedLock<Poco::FastMutex> l(lock);
+            limit = std::min<unsigned>(limit, state.size());
+            for (unsigned i = 0; i < limit; ++i) {
+                if (state[i] != FINISHED) return false;
+            }
+            return true;
+        }
+
+        unsigned finished () {
+            Poco::ScopedLock<Poco::FastMutex> l(lock);
+            return order.size();
+        }
+
+        // index of the i-th finished feature
+        unsigned completed (unsigned i) {
+            Poco::ScopedLock<Poco::FastMutex> l(lock);
+            BOOST_VERIFY(i < order.size());
+            return order[i];
+        }
+
+        const std::vector<ImageID> &get (unsigned idx) const {
+            BOOST_VERIFY(idx < results.size());
+            return results[idx];
+        }
+
+        // Serializes the sessions sharing this retrieval.  The methods
+        // below must be called with the mutex held.  Only the features
+        // before limit are searched.
+        Poco::Mutex &getMutex () {
+            return mutex;
+        }
+
+        void batch (unsigned limit) {
+            limit = std::min<unsigned>(limit, state.size());
+            if (done(limit)) return;
+            std::vector<Feature> features(record.features.begin(), record.features.begin() + limit);
+            std::vector<std::vector<ImageID> > found;
+            std::vector<uint64_t> bytes;
+            generation->getSketchDB().search(features, &found, 0, &bytes);
+            BOOST_FOREACH(uint64_t b, bytes) {
+                __sync_fetch_and_add(&scanned, b);
+            }
+            Poco::ScopedLock<Poco::FastMutex> l(lock);
+            for (unsigned i = 0; i < limit; ++i) {
+                if (state[i] == PENDING) {
+                    results[i].swap(found[i]);
+                    publish(i);
+                }
+            }
+            next = std::max(next, limit);
+        }
+
+        // Searches the pending features before limit of several retrievals
+        // of the same generation with a single DB::batch.  The mutexes of
+        // the retrievals must be held.
+        static void batch (const std::vector<Retrieval *> &retrievals, unsigned limit) {
+            if (retrievals.empty()) return;
+            std::vector<Feature> features;
+            std::vector<std::pair<Retrieval *, unsigned> > owners;
+            BOOST_FOREACH(Retrieval *r, retrievals) {
+                Poco::ScopedLock<Poco::FastMutex> l(r->lock);
+                unsigned n = std::min<unsigned>(limit, r->state.size());
+                for (unsigned i = 0; i < n; ++i) {
+                    if (r->state[i] == PENDING) {
+                        features.push_back(r->record.features[i]);
+                        owners.push_back(std::make_pair(r, i));
+                    }
+                }
+            }
+            if (features.empty()) return;
+            std::vector<std::vector<ImageID> > found;
+            std::vector<uint64_t> bytes;
+            retrievals.front()->generation->getSketchDB().search(features, &found, 0, &bytes);
+            for (unsigned k = 0; k < owners.size(); ++k) {
+                Retrieval *r = owners[k].first;
+                unsigned i = owners[k].second;
+                __sync_fetch_and_add(&r->scanned, bytes[k]);
+                Poco::ScopedLock<Poco::FastMutex> l(r->lock);
+                if (r->state[i] == PENDING) {
+                    r->results[i].swap(found[k]);
+                    r->publish(i);
+                }
+            }
+            BOOST_FOREACH(Retrieval *r, retrievals) {
+                Poco::ScopedLock<Poco::FastMutex> l(r->lock);
+                r->next = std::max<unsigned>(r->next, std::min<unsigned>(limit, r->state.size()));
+            }
+        }
+
+        void progress (unsigned limit) {
+            limit = std::min<unsigned>(limit, state.size());
+            while ((next < limit) && (state[next] != PENDING)) ++next;
+            if (next >= limit) return;
+            generation->getSketchDB().search(record.features[next], &results[next], 0, &scanned);
+            Poco::ScopedLock<Poco::FastMutex> l(lock);
+            publish(next);
+            ++next;
+        }
+
+        // Submits the pending features to the pool.
+        void schedule (TaskPool &pool, unsigned limit) {
+            std::vector<unsigned> todo;
+            claim(limit, &todo);
+            BOOST_FOREACH(unsigned i, todo) {
+                pool.submit(new Task(this, i));
+            }
+        }
+
+        // Submits the pending features to the batch scheduler.
+        void schedule (BatchScheduler &scheduler, unsigned limit) {
+            std::vector<unsigned> todo;
+            claim(limit, &todo);
+            std::vector<BatchScheduler::Request> requests(todo.size());
+            for (unsigned i = 0; i < todo.size(); ++i) {
+                BatchScheduler::Request &req = requests[i];
+                req.db = &generation->getSketchDB();
+                req.query = &record.features[todo[i]];
+                req.result = &results[todo[i]];
+                req.stop = &stop;
+                req.bytes = &scanned;
+                req.client = this;
+                req.tag = todo[i];
+            }
+            scheduler.submit(requests);
+        }
+
+        // Waits until a scheduled feature returns or the time is up.
+        void wait (long milisecond) {
+            event.tryWait(milisecond);
+        }
+
+        // Aborts the scheduled features that are still running and waits
+        // for them to return.  Aborted features become pending again.
+        void cancel () {
+            stop = true;
+            for (;;) {
+                {
+                    Poco::ScopedLock<Poco::FastMutex> l(lock);
+                    if (running == 0) break;
+                }
+                event.tryWait(SEARCH_POLL_INTERVAL);
+            }
+            stop = false;
+        }
+
+        const Record &getRecord() const {
+            return record;
+        }
+
+        const Generation::Ptr &getGeneration () const {
+            return generation;
+        }
+    };
+
+    // Re-ranks the top candidates of an image query by geometric
+    // verification against their indexed records, within a time budget.
+    // Candidates with at least VERIFY_MIN_INLIERS inliers come first, by
+    // # inliers; the rest keep their order.  Candidates are verified in
+    // parallel on the SearchPool.
+    class Verification {
+        class Task: public TaskPool::Task {
+            Verification *owner;
+            unsigned index;
+        public:
+            Task (Verification *o, unsigned i): owner(o), index(i) {
+            }
+            void run () {
+                owner->verify(index);
+            }
+        };
+
+        const Record &query;
+        ImageDB &db;
+        GeometricVerifier verifier;
+        Timer timer;
+        std::vector<ImageID> ids;
+        std::vector<int> inliers;   // -1 if not verified
+        unsigned left;
+        Poco::FastMutex lock;
+        Poco::Event event;
+
+        void verify (unsigned idx) {
+            if (!timer.timeout()) {
+                bool hit;
+                Poco::SharedPtr<Record> rec = db.get(ids[idx], &hit);
+                if (!rec.isNull()) {
+                    inliers[idx] = verifier.verify(query, *rec);
+                }
+            }
+            Poco::ScopedLock<Poco::FastMutex> l(lock);
+            --left;
+            // under the lock: apply returns and frees us once left is 0
+            event.set();
+        }
+
+    public:
+        Verification (const Record &query_, ImageDB &db_, unsigned milisecond)
+            : query(query_), db(db_), timer(milisecond), left(0) {
+        }
+
+        // returns the # candidates verified
+        unsigned apply (std::vector<ImageID> *results, unsigned top) {
+            unsigned n = std::min<unsigned>(top, results->size());
+            ids.assign(results->begin(), results->begin() + n);
+            inliers.assign(n, -1);
+            left = n;
+            TaskPool *pool = SearchPool::instance();
+            if (pool != 0) {
+                for (unsigned i = 0; i < n; ++i) {
+                    pool->submit(new Task(this, i));
+                }
+                for (;;) {
+                    {
+                        Poco::ScopedLock<Poco::FastMutex> l(lock);
+                        if (left == 0) break;
+                    }
+                    event.tryWait(SEARCH_POLL_INTERVAL);
+                }
+            }
+            else {
+                for (unsigned i = 0; i < n; ++i) {
+                    verify(i);
+                }
+            }
+            std::vector<std::pair<int, unsigned> > order(n);
+            unsigned verified = 0;
+            for (unsigned i = 0; i < n; ++i) {
+                if (inliers[i] >= 0) ++verified;
+                order[i] = std::make_pair(inliers[i] >= VERIFY_MIN_INLIERS ? -inliers[i] : 0, i);
+            }
+            std::sort(order.begin(), order.end());
+            for (unsigned i = 0; i < n; ++i) {
+                results->at(i) = ids[order[i].second];
+            }
+            return verified;
+        }
+    };
+
+    class RetrievalCache: public Poco::LRUCache<std::string, Retrieval> {
+
+        static Poco::LRUCache<std::string, Retrieval> *inst;
+    public:
+        static void init (const Poco::Util::AbstractConfiguration &config) {
+            BOOST_VERIFY(inst == 0);
+            inst = new Poco::LRUCache<std::string, Retrieval>(config.getInt("nise.retrieval.cache",
+                                                                RETRIEVAL_CACHE_DEFAULT));
+            Log::system().information("Retrieval cache started.");
+        }
+
+        static void cleanup (void) {
+            BOOST_VERIFY(inst != 0);
+            delete inst;
+            inst = 0;
+            Log::system().information("Retrieval cache stopped.");
+        }
+
+        static Poco::LRUCache<std::string, Retrieval> &instance () {
+            return *inst;
+        }
+
+        // Collects up to max features of the cached queries, to warm up a
+        // new generation with.
+        static void sample (unsigned max, std::vector<Feature> *features) {
+            std::set<std::string> keys = inst->getAllKeys();
+            BOOST_FOREACH(const std::string &key, keys) {
+                Poco::SharedPtr<Retrieval> r = inst->get(key);
+                if (r.isNull()) continue;
+                const std::vector<Feature> &f = r->getRecord().features;
+                for (unsigned i = 0; (i < f.size()) && (features->size() < max); ++i) {
+                    features->push_back(f[i]);
+                }
+                if (features->size() >= max) break;
+            }
+        }
+    };
+
+    // Retrievals saved on disk under nise.retrieval.store, so that repeated
+    // queries skip extraction and scanning, also across restarts.  A
+    // saved retrieval is the record with the finished feature results,
+    // tagged with the fingerprint of the generation that found them; on
+    // load, results of another generation are dropped and only the record
+    // is used.  Files are removed least recently used first when they
+    // take more than nise.retrieval.store.size MB, and the most recently
+    // used are loaded into the RetrievalCache on startup.
+    //
+    //   Signature::RETRIEVAL
+    //   uint64 fingerprint
+    //   Record
+    //   uint32 # results
+    //   each: uint32 feature, vector<ImageID>
+    //
+    // Saves are written by a background thread; at most
+    // nise.retrieval.store.queue retrievals wait for it, beyond that a
+    // save is dropped and left to the next one of the same retrieval.
+    class RetrievalStore: public Poco::Runnable {
+        struct Entry {
+            uint64_t size;
+            int64_t used;
+        };
+
+        std::string dir;
+        uint64_t budget;
+        uint64_t total;
+        std::map<std::string, Entry> files;             // by hex checksum
+        std::set<std::pair<int64_t, std::string> > lru; // (used, hex)
+        Poco::FastMutex mutex;
+
+        std::deque<Poco::SharedPtr<Retrieval> > queue;  // to be saved
+        std::set<const Retrieval *> queued;
+        unsigned capacity;
+        Poco::FastMutex queue_mutex;                    // protects queue & queued
+        Poco::Event event;
+        volatile bool done;
+        Poco::Thread thread;
+
+        static RetrievalStore *inst;
+
+        std::string path (const std::string &hex) const {
+            return dir + '/' + hex.substr(0, 2) + '/' + hex;
+        }
+
+        // Called with the mutex held.
+        void touch (const std::string &hex, uint64_t size, int64_t used) {
+            std::map<std::string, Entry>::iterator it = files.find(hex);
+            if (it != files.end()) {
+                total -= it->second.size;
+                lru.erase(std::make_pair(it->second.used, hex));
+            }
+            Entry &e = files[hex];
+            e.size = size;
+            e.used = used;
+            total += size;
+            lru.insert(std::make_pair(used, hex));
+            while ((total > budget) && (files.size() > 1)) {
+                std::string old = lru.begin()->second;
+                lru.erase(lru.begin());
+                total -= files[old].size;
+                files.erase(old);
+                try {
+                    Poco::File(path(old)).remove();
+                }
+                catch (const Poco::Exception &) {
+                }
+            }
+        }
+
+        void scan () {
+            Poco::File(dir).createDirectories();
+            Poco::DirectoryIterator end;
+            for (Poco::DirectoryIterator sub(dir); sub != end; ++sub) {
+                if (!sub->isDirectory()) continue;
+                for (Poco::DirectoryIterator it(*sub); it != end; ++it) {
+                    const std::string &name = it.name();
+                    if (name.find('.') != name.npos) {  // unfinished save
+                        Poco::File(it->path()).remove();
+                        continue;
+                    }
+                    touch(name, it->getSize(), it->getLastModified().epochMicroseconds());
+                }
+            }
+        }
+
+        RetrievalStore (const std::string &dir_, uint64_t budget_, unsigned capacity_)
+            : dir(dir_), budget(budget_), total(0), capacity(capacity_), done(false) {
+            scan();
+            thread.start(*this);
+        }
+
+        // The saves still queued are written first.
+        ~RetrievalStore () {
+            done = true;
+            event.set();
+            thread.join();
+        }
+
+        // loads the most recently used retrievals into the cache
+        void warm (unsigned max) {
+            std::vector<std::string> hot;
+            {
+                Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+                std::set<std::pair<int64_t, std::string> >::reverse_iterator it = lru.rbegin();
+                while ((it != lru.rend()) && (hot.size() < max)) {
+                    hot.push_back(it->second);
+                    ++it;
+                }
+            }
+            Generation::Ptr generation = Generation::get();
+            BOOST_FOREACH(const std::string &hex, hot) {
+                std::string checksum;
+                try {
+                    checksum = HexToString(hex);
+                }
+                catch (const Poco::Exception &) {
+                    continue;
+                }
+                Poco::SharedPtr<Retrieval> r = read(hex, generation);
+                if (!r.isNull()) {
+                    RetrievalCache::instance().add(checksum, r);
+                }
+            }
+        }
+
+        Poco::SharedPtr<Retrieval> read (const std::string &hex, const Generation::Ptr &generation) {
+            Poco::SharedPtr<Retrieval> r;
+            std::ifstream is(path(hex).c_str(), std::ios::binary);
+            if (!is) return r;
+            Signature::RETRIEVAL.check(is);
+            uint64_t fingerprint = ReadUint64(is);
+            Record record;
+            record.readFields(is);
+            if (!is) return r;
+            r = Retrieval::fromRecord(record, generation);
+            if (fingerprint == generation->getFingerprint()) {
+                unsigned n = ReadUint32(is);
+                for (unsigned i = 0; is && (i < n); ++i) {
+                    unsigned idx = ReadUint32(is);
+                    std::vector<ImageID> found;
+                    ReadVector(is, &found);
+                    if (!is) break;
+                    r->restore(idx, &found);
+                }
+            }
+            return r;
+        }
+
+    public:
+        static void init (const Poco::Util::AbstractConfiguration &config) {
+            BOOST_VERIFY(inst == 0);
+            std::string dir = config.getString("nise.retrieval.store", "");
+            if (dir.empty()) return;
+            inst = new RetrievalStore(dir, uint64_t(config.getInt("nise.retrieval.store.size",
+                                                                  RETRIEVAL_STORE_DEFAULT)) << 20,
+                                      config.getInt("nise.retrieval.store.queue", RETRIEVAL_STORE_QUEUE));
+            inst->warm(config.getInt("nise.retrieval.store.warm", RETRIEVAL_STORE_WARM));
+            Log::system().information("Retrieval store started.");
+        }
+
+        static void cleanup (void) {
+            if (inst == 0) return;
+            delete inst;
+            inst = 0;
+            Log::system().information("Retrieval store stopped.");
+        }
+
+        // NULL if retrievals are not saved.
+        static RetrievalStore *instance () {
+            return inst;
+        }
+
+        // NULL if the query has not been saved
+        Poco::SharedPtr<Retrieval> load (const std::string &checksum, const Generation::Ptr &generation) {
+            std::string hex = StringToHex(checksum);
+            Poco::SharedPtr<Retrieval> r = read(hex, generation);
+            if (r.isNull()) {
+                Metrics::instance().store_miss.add();
+                return r;
+            }
+            Metrics::instance().store_hit.add();
+            Poco::Timestamp now;
+            try {
+                Poco::File(path(hex)).setLastModified(now);
+            }
+            catch (const Poco::Exception &) {
+            }
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            std::map<std::string, Entry>::const_iterator it = files.find(hex);
+            if (it != files.end()) touch(hex, it->second.size, now.epochMicroseconds());
+            return r;
+        }
+
+        // Queues the retrieval to be saved in the background.
+        void save (const Poco::SharedPtr<Retrieval> &r) {
+            {
+                Poco::ScopedLock<Poco::FastMutex> lock(queue_mutex);
+                if ((queue.size() >= capacity) || !queued.insert(r.get()).second) return;
+                queue.push_back(r);
+            }
+            event.set();
+        }
+
+        // the writer thread
+        void run () {
+            for (;;) {
+                bool last = done;
+                for (;;) {
+                    Poco::SharedPtr<Retrieval> r;
+                    {
+                        Poco::ScopedLock<Poco::FastMutex> lock(queue_mutex);
+                        if (queue.empty()) break;
+                        r = queue.front();
+                        queue.pop_front();
+                        queued.erase(r.get());
+                    }
+                    write(*r);
+                }
+                if (last) break;
+                event.wait();
+            }
+        }
+
+    private:
+        // Saves the retrieval if features have finished since it was last
+        // saved or loaded.  Written to a temporary file and renamed, so a
+        // file is either complete or absent.
+        void write (Retrieval &r) {
+            std::vector<unsigned> finished;
+            if (!r.checkpoint(&finished)) return;
+            const Record &record = r.getRecord();
+            std::string hex = StringToHex(record.checksum);
+            std::string file = path(hex);
+            std::string tmp = file + '.' + boost::lexical_cast<std::string>(Poco::Thread::currentTid());
+            try {
+                Poco::File(dir + '/' + hex.substr(0, 2)).createDirectories();
+                {
+                    std::ofstream os(tmp.c_str(), std::ios::binary);
+                    Signature::RETRIEVAL.write(os);
+                    WriteUint64(os, r.getGeneration()->getFingerprint());
+                    record.write(os);
+                    WriteUint32(os, finished.size());
+                    BOOST_FOREACH(unsigned idx, finished) {
+                        WriteUint32(os, idx);
+                        WriteVector(os, r.get(idx));
+                    }
+                    if (!os) throw Poco::WriteFileException(tmp);
+                }
+                Poco::File(tmp).renameTo(file);
+                r.commit(finished.size());
+                uint64_t size = Poco::File(file).getSize();
+                Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+                touch(hex, size, Poco::Timestamp().epochMicroseconds());
+            }
+            catch (const Poco::Exception &e) {
+                Log::system().error("Cannot save retrieval: " + e.displayText());
+                try {
+                    Poco::File(tmp).remove();
+                }
+                catch (const Poco::Exception &) {
+                }
+            }
+        }
+    };
+
+    // Loads a new index generation on a background thread, warmed with
+    // the cached queries.  The new indexes are named either by the
+    // server configuration, for a rebuild written over the old files, or
+    // by another configuration file.
+    class Reloader: public Poco::Runnable {
+        const Poco::Util::AbstractConfiguration &config;
+        std::string key;        // required by /admin/reload, disabled if empty
+        std::string path;
+        bool busy;
+        std::string status;
+        Poco::FastMutex mutex;  // protects busy & status
+        Poco::Thread thread;
+
+        Reloader (const Poco::Util::AbstractConfiguration &config_)
+            : config(config_), key(config_.getString("nise.admin.key", "")), busy(false), status("idle") {
+        }
+
+        ~Reloader () {
+            if (thread.isRunning()) thread.join();
+        }
+
+        static Reloader *inst;
+
+        void setStatus (const std::string &s) {
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            status = s;
+            busy = false;
+        }
+
+    public:
+        static void init (const Poco::Util::AbstractConfiguration &config) {
+            BOOST_VERIFY(inst == 0);
+            inst = new Reloader(config);
+        }
+
+        static void cleanup (void) {
+            BOOST_VERIFY(inst != 0);
+            delete inst;
+            inst = 0;
+        }
+
+        static Reloader &instance () {
+            return *inst;
+        }
+
+        bool authorize (const std::string &k) const {
+            return !key.empty() && (k == key);
+        }
+
+        // Starts a reload from the configuration file at path, or from the
+        // server configuration if path is empty.  False if a reload is
+        // already running.
+        bool start (const std::string &path_) {
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            if (busy) return false;
+            if (thread.isRunning()) thread.join();
+            busy = true;
+            path = path_;
+            status = "loading";
+            thread.start(*this);
+            return true;
+        }
+
+        std::string getStatus () {
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            return status;
+        }
+
+        void run () {
+            try {
+                Poco::AutoPtr<Poco::Util::AbstractConfiguration> file;
+                if (!path.empty()) {
+                    file = new Poco::Util::XMLConfiguration(path);
+                }
+                std::vector<Feature> queries;
+                RetrievalCache::sample(GENERATION_WARM_FEATURES, &queries);
+                unsigned serial = Generation::reload(file.isNull() ? config : *file, queries);
+                // the cached retrievals belong to the old generation
+                RetrievalCache::instance().clear();
+                setStatus("generation " + boost::lexical_cast<std::string>(serial));
+            }
+            catch (const Poco::Exception &e) {
+                Log::system().error("Reload failed: " + e.displayText());
+                setStatus("failed: " + e.displayText());
+            }
+            catch (const std::exception &e) {
+                Log::system().error(std::string("Reload failed: ") + e.what());
+                setStatus(std::string("failed: ") + e.what());
+            }
+        }
+    };
+
+    class Session {
+    public:
+        enum Type {
+            RANDOM = 0,
+            LOCAL = 1,
+            IMAGE = 2
+        };
+
+        // Why an image session stopped searching features.
+        enum Stop {
+            STOP_NONE = 0,  // still searching
+            STOP_COMPLETE,  // all features searched
+            STOP_TIMEOUT,   // time is up with enough results
+            STOP_STABLE     // ranking converged, see Parameter
+        };
+
+        struct Parameter {
+            bool expansion;
+            bool batch;
+            Box box;
+            bool crop;
+            // Early termination: stop once the first stable_top results
+            // have not changed for stable features in a row, and the lead
+            // of the first over the second exceeds margin times the number
+            // of features left.  With margin = 1 the leader can no longer
+            // be overturned.  stable = 0 disables the rule.
+            unsigned stable;
+            unsigned stable_top;
+            float margin;
+            // geometric verification of the first verify results,
+            // in at most verify_time miliseconds; 0 to disable
+            unsigned verify;
+            unsigned verify_time;
+            // only search the first features of the query; 0 for all
+            unsigned features;
+            // interactive queries are extracted before those of batch
+            // clients (log=0)
+            bool interactive;
+            // one result per cluster of near-identical images, see
+            // ClusterMap
+            bool cluster;
+        };
+
+        static const char *stopName (Stop stop) {
+            static const char *names[] = {"none", "complete", "timeout", "stable"};
+            return names[stop];
+        }
+
+    private:
+
+        Poco::UUID id;
+
+        Type method;
+
+        ImageID local;
+        Generation::Ptr generation;
+        Poco::SharedPtr<Retrieval> retrieval;
+
+        Parameter param;
+
+        bool done;
+        unsigned empty;
+        unsigned finished;
+        // # first results already served while the search was running;
+        // they keep their place, only the rest is ranked again
+        unsigned served;
+
+        Ranking ranking;
+        std::vector<ImageID> results;
+        // size of the cluster of each result if collapsed, else empty
+        std::vector<unsigned> counts;
+
+        std::vector<ImageID> leaders;   // the top results at the last change
+        unsigned stable;                // # features merged since then
+        Stop stop;
+        unsigned verified;
+
+        float time;
+        // A session can be accessed and manipulated by one thread
+        Poco::Mutex mutex;
+
+        static Poco::UUIDGenerator uuid;
+
+        void sync () {
+            poco_check_ptr(retrieval);
+            const Record &record = retrieval->getRecord();
+            poco_assert(record.regions.size() == record.features.size());
+            unsigned before = finished;
+            while (finished < retrieval->finished()) {
+                unsigned idx = retrieval->completed(finished);
+                if (retrieval->get(idx).empty()) {
+                    ++empty;
+                }
+                else {
+                    const Region &region = record.regions[idx];
+
                     bool in = (region.x >= param.box.left * record.meta.width) 
                         && (region.x <= param.box.right * record.meta.width)
                         && (region.y >= param.box.top * record.meta.height)
                         && (region.y <= param.box.bottom * record.meta.height);
 
                     if (param.crop == in) {
-                        BOOST_FOREACH(ImageID v, retrieval->get(finished)) {
-                            if (!seen.count(v)) {
-                                seen.insert(v);
-                                results.push_back(v);
-                            }
+                        ranking.next();
+                        BOOST_FOREACH(ImageID v, retrieval->get(idx)) {
+                            ranking.vote(v, key(v));
                         }
                     }
                 }
                 ++finished;
             }
+            ranking.update();
+            if (served == 0) {
+                results = ranking.top();
+            }
+            else {
+                results.resize(std::min<unsigned>(served, results.size()));
+                append(ranking.top());
+            }
+
+            if (finished > before) {
+                unsigned n = std::min<unsigned>(param.stable_top, results.size());
+                if ((n == leaders.size()) && std::equal(leaders.begin(), leaders.end(), results.begin())) {
+                    stable += finished - before;
+                }
+                else {
+                    leaders.assign(results.begin(), results.begin() + n);
+                    stable = 0;
+                }
+            }
+        }
+
+        // The ranking key of an image: its cluster, represented by the
+        // canonical member, when results are collapsed, so that the
+        // images of a cluster pool their votes and take one place before
+        // truncation and the stability check.
+        ImageID key (ImageID v) const {
+            const ClusterMap &clusters = generation->getClusters();
+            if (!param.cluster || clusters.empty()) return v;
+            return clusters.canonical(v);
+        }
+
+        // Appends the images of more not already in the results.
+        void append (const std::vector<ImageID> &more) {
+            std::set<ImageID> seen(results.begin(), results.end());
+            BOOST_FOREACH(ImageID v, more) {
+                if (seen.insert(v).second) results.push_back(v);
+            }
+        }
+
+        // Keeps the best ranked image of each cluster in the results, which
+        // the ranking already does except for the images added by
+        // verification and expansion, and counts the cluster sizes.
+        void collapse () {
+            counts.clear();
+            const ClusterMap &clusters = generation->getClusters();
+            if (!param.cluster || clusters.empty()) return;
+            std::vector<ImageID> kept;
+            std::set<uint32_t> seen;
+            BOOST_FOREACH(ImageID v, results) {
+                uint32_t c = clusters.get(v);
+                if ((c != ClusterMap::NONE) && !seen.insert(c).second) continue;
+                kept.push_back(v);
+                counts.push_back(clusters.size(c));
+            }
+            results.swap(kept);
+        }
+
+        // # features to search
+        unsigned budget () const {
+            unsigned n = retrieval->size();
+            if (param.features && (param.features < n)) n = param.features;
+            return n;
+        }
+
+        bool converged () const {
+            if (param.stable == 0) return false;
+            if (stable < param.stable) return false;
+            if (results.empty()) return false;
+            float lead = ranking.score(key(results[0]));
+            if (results.size() > 1) {
+                lead -= ranking.score(key(results[1]));
+            }
+            return lead > param.margin * (finished < budget() ? budget() - finished : 0);
         }
     public:
+        // The retrieval of a query from the RetrievalCache or the
+        // RetrievalStore; null if the query has to be extracted.
+        static Poco::SharedPtr<Retrieval> lookup (const std::string &checksum, const Generation::Ptr &generation) {
+            Poco::SharedPtr<Retrieval> retrieval = RetrievalCache::instance().get(checksum);
+            if (!retrieval.isNull() && (retrieval->getGeneration() != generation)) {
+                retrieval = 0;
+            }
+            if (!retrieval.isNull()) {
+                Metrics::instance().retrieval_hit.add();
+                return retrieval;
+            }
+            Metrics::instance().retrieval_miss.add();
+            RetrievalStore *store = RetrievalStore::instance();
+            if (store != 0) {
+                retrieval = store->load(checksum, generation);
+            }
+            if (!retrieval.isNull()) {
+                RetrievalCache::instance().add(checksum, retrieval);
+            }
+            return retrieval;
+        }
+
         Session (const Parameter &p)
-            : id(uuid.create()), method(RANDOM), local(0), param(p), done(false), empty(0), finished(0) {
+            : id(uuid.create()), method(RANDOM), local(0), generation(Generation::get()), param(p), done(false), empty(0), finished(0), served(0), ranking(MAX_RANKED_RESULTS), stable(0), stop(STOP_NONE), verified(0) {
         }
 
         Session (ImageID id, const Parameter &p)
-            : id(uuid.create()), method(LOCAL), local(id), param(p), done(false), empty(0), finished(0)
+            : id(uuid.create()), method(LOCAL), local(id), generation(Generation::get()), param(p), done(false), empty(0), finished(0), served(0), ranking(MAX_RANKED_RESULTS), stable(0), stop(STOP_NONE), verified(0)
         {
         }
 
         Session (const std::string &query, const Parameter &p)
-            : id(uuid.create()), method(IMAGE), local(0), param(p), done(false), empty(0), finished(0)
+            : id(uuid.create()), method(IMAGE), local(0), generation(Generation::get()), param(p), done(false), empty(0), finished(0), served(0), ranking(MAX_RANKED_RESULTS), stable(0), stop(STOP_NONE), verified(0)
         {
             std::string checksum;
             Checksum(query, &checksum);
 
-            retrieval = RetrievalCache::instance().get(checksum);
-
+            retrieval = lookup(checksum, generation);
             if (retrieval.isNull()) {
-                Extractor xtor;
                 Record record;
-                xtor.extract(query, &record, true);
-                retrieval = Retrieval::fromRecord(record);
+                ExtractionPool *pool = ExtractionPool::instance();
+                if (pool == 0) {
+                    Extractor::local().extract(query, &record, true);
+                }
+                else if (!pool->extract(query, &record, param.interactive)) {
+                    throw OverloadException("no extraction capacity");
+                }
+                retrieval = Retrieval::fromRecord(record, generation);
                 RetrievalCache::instance().add(checksum, retrieval);
             }
         }
 
         Session (Record &query, const Parameter &p)
-            : id(uuid.create()), method(IMAGE), local(0), param(p), done(false), empty(0), finished(0)
+            : id(uuid.create()), method(IMAGE), local(0), generation(Generation::get()), param(p), done(false), empty(0), finished(0), served(0), ranking(MAX_RANKED_RESULTS), stable(0), stop(STOP_NONE), verified(0)
         {
-            retrieval = RetrievalCache::instance().get(query.checksum);
-
+            retrieval = lookup(query.checksum, generation);
             if (retrieval.isNull()) {
-                retrieval = Retrieval::fromRecord(query);
-                RetrievalCache::instance().add(query.checksum, retrieval);
+                std::string checksum(query.checksum);
+                retrieval = Retrieval::fromRecord(query, generation);
+                RetrievalCache::instance().add(checksum, retrieval);
             }
         }
 
+        // a query already looked up or extracted, see lookup
+        Session (const Poco::SharedPtr<Retrieval> &r, const Parameter &p)
+            : id(uuid.create()), method(IMAGE), local(0), generation(r->getGeneration()), retrieval(r), param(p), done(false), empty(0), finished(0), served(0), ranking(MAX_RANKED_RESULTS), stable(0), stop(STOP_NONE), verified(0)
+        {
+        }
+
         ~Session () {
         }
 
@@ -678,44 +2575,90 @@ namespace nise {
             param = new_param;
             done = false;
             finished = 0;
-            seen.clear();
+            served = 0;
+            ranking.clear();
             results.clear();
+            leaders.clear();
+            stable = 0;
+            stop = STOP_NONE;
+            verified = 0;
         }
 
         const Poco::SharedPtr<Retrieval> &getRetrieval () const {
             return retrieval;
         }
 
+        Stop getStop () const {
+            return stop;
+        }
+
+        // memory owned by the session; the retrieval is shared and
+        // accounted by RetrievalCache
+        size_t bytes () {
+            Poco::ScopedLock<Poco::Mutex> lock(mutex);
+            return sizeof(Session) + ranking.bytes()
+                + (results.capacity() + leaders.capacity()) * sizeof(ImageID)
+                + counts.capacity() * sizeof(unsigned);
+        }
+
+        // Searches the features of many image sessions with one DB::batch,
+        // for /search/batch; Session::run then only ranks.  The sessions
+        // should share the parameters.  Retrievals of another generation
+        // than the first, or busy with other sessions, are left to run.
+        static void prefetch (const std::vector<Poco::SharedPtr<Session> > &sessions) {
+            std::vector<Retrieval *> retrievals;
+            std::set<Retrieval *> seen;
+            std::vector<Poco::Mutex *> locked;
+            unsigned limit = 0;
+            BOOST_FOREACH(const Poco::SharedPtr<Session> &session, sessions) {
+                if (session->method != IMAGE) continue;
+                Retrieval *r = session->retrieval.get();
+                if (!retrievals.empty() && (r->getGeneration() != retrievals.front()->getGeneration())) continue;
+                // the same record might appear more than once
+                if (!seen.insert(r).second) continue;
+                if (!r->getMutex().tryLock()) continue;
+                locked.push_back(&r->getMutex());
+                retrievals.push_back(r);
+                limit = std::max(limit, session->budget());
+            }
+            try {
+                Retrieval::batch(retrievals, limit);
+            }
+            catch (...) {
+                BOOST_FOREACH(Poco::Mutex *m, locked) m->unlock();
+                throw;
+            }
+            BOOST_FOREACH(Poco::Mutex *m, locked) m->unlock();
+        }
+
+        // # features that were not searched because of early termination
+        unsigned saved () const {
+            if (stop != STOP_STABLE) return 0;
+            return finished < budget() ? budget() - finished : 0;
+        }
+
         void run (unsigned goal, Timer &timer) {
             Poco::ScopedLock<Poco::Mutex> lock(mutex);
             if (!done) {
+                StageTimer stage(Metrics::instance().search);
                 if (method == RANDOM) {
                     results.resize(goal);
-                    ImageID max = ImageDB::instance().size();
-                    Expansion &exp = Expansion::instance();
-
-                    if (exp.size() * 10 < max) {
-                        BOOST_FOREACH(ImageID &v, results) {
-                            v = rand() % max;
-                        }
-                    }
-                    else {
-                        BOOST_FOREACH(ImageID &v, results) {
-                            for (;;) {
-                                v = rand() % max;
-                                Graph::Range range = exp.neighbors(v);
-                                if (range.second - range.first > 5) break;
-                            }
-                        }
+                    ImageID max = generation->getImageDB().size();
+                    const Expansion &exp = generation->getExpansion();
+                    BOOST_FOREACH(ImageID &v, results) {
+                        v = exp.random(max);
                     }
                 }
                 else if (method == LOCAL) {
+                    const Expansion &exp = generation->getExpansion();
                     if (param.expansion) {
-                        results.push_back(local);
-                        Expansion::instance().apply(&results);
+                        if (!exp.lookup(local, &results)) {
+                            results.push_back(local);
+                            exp.apply(&results);
+                        }
                     }
                     else {
-                        Graph::Range range = Expansion::instance().neighbors(local);
+                        Graph::Range range = exp.neighbors(local);
                         results.push_back(local);
                         BOOST_FOREACH(ImageID id, range) {
                             results.push_back(id);
@@ -725,41 +2668,85 @@ namespace nise {
                 }
                 else if (method == IMAGE) {
                     Poco::ScopedLock<Poco::Mutex> lock(retrieval->getMutex());
+                    TaskPool *pool = SearchPool::instance();
+                    BatchScheduler *scheduler = BatchScheduler::instance();
+                    unsigned limit = budget();
                     sync();
-                    for (;;) {
-                        if (retrieval->done()) break;
+                    if (((pool != 0) || (scheduler != 0)) && !param.batch) {
+                        if (scheduler != 0) {
+                            retrieval->schedule(*scheduler, limit);
+                        }
+                        else {
+                            retrieval->schedule(*pool, limit);
+                        }
+                        for (;;) {
+                            if (retrieval->done(limit)) break;
+                            if (converged()) break;
+                            if ((results.size() > goal) && timer.timeout()) break;
+                            retrieval->wait(SEARCH_POLL_INTERVAL);
+                            sync();
+                        }
+                        retrieval->cancel();
+                        sync();
+                    }
+                    else for (;;) {
+                        if (retrieval->done(limit)) break;
+                        if (converged()) break;
                         if ((results.size() > goal) && timer.timeout()) break;
                         if (param.batch) {
-                            retrieval->batch();
+                            retrieval->batch(limit);
                         }
                         else {
-                            retrieval->progress();
+                            retrieval->progress(limit);
                         }
                         sync();
                     }
-                    if (retrieval->done()) {
+                    if (retrieval->done(limit)) {
+                        stop = STOP_COMPLETE;
+                    }
+                    else if (converged()) {
+                        stop = STOP_STABLE;
+                    }
+                    else {
+                        stop = STOP_TIMEOUT;
+                    }
+                    if (stop != STOP_TIMEOUT) {
+                        // the results already served stay in place
+                        std::vector<ImageID> tail(results.begin() + std::min<unsigned>(served, results.size()), results.end());
+                        results.resize(results.size() - tail.size());
+                        if (param.verify) {
+                            StageTimer stage(Metrics::instance().verify);
+                            Verification verification(retrieval->getRecord(), generation->getImageDB(), param.verify_time);
+                            verified = verification.apply(&tail, param.verify);
+                        }
                         if (param.expansion) {
-                            Expansion::instance().apply(&results);
+                            generation->getExpansion().apply(&tail);
                         }
+                        append(tail);
                         done = true;
                     }
+                    RetrievalStore *store = RetrievalStore::instance();
+                    if (store != 0) {
+                        store->save(retrieval);
+                    }
                 }
                 else BOOST_VERIFY(0);
+                if (method != RANDOM) collapse();
+                if (done) {
+                    // only the results are needed from now on
+                    ranking.release();
+                    std::vector<ImageID>().swap(leaders);
+                    std::vector<ImageID>(results).swap(results);
+                    std::vector<unsigned>(counts).swap(counts);
+                }
                 time = timer.elapsed();
             }
         }
 
-        void serve (std::ostream &os, unsigned start, unsigned count, const std::string &tag = "") {
-            Poco::ScopedLock<Poco::Mutex> lock(mutex);
-
-            unsigned max_count = 0;
-            if (start < results.size()) {
-                max_count = results.size() - start;
-            }
-            if (count > max_count) count = max_count;
-            if (count == 0) count = max_count;
-
-            JSON json(os);
+    private:
+        // the fields of a response, W is JSON or BIN
+        template <typename W>
+        void fields (W &json, unsigned start, unsigned count, const std::string &tag) {
             json.add("done", done);
 
 
@@ -771,6 +2758,9 @@ namespace nise {
                     .add("retrieve.total", retrieval->size())
                     .add("retrieve.done", finished)
                     .add("retrieve.empty", empty)
+                    .add("retrieve.saved", saved())
+                    .add("stop", stopName(stop))
+                    .add("verified", verified)
                     .add("sha1", StringToHex(record.checksum));
             }
             else {
@@ -778,7 +2768,8 @@ namespace nise {
             }
 
             if (method == LOCAL) {
-                json.add("tiny", "/thumb?id=" + boost::lexical_cast<std::string>(local));
+                json.add("tiny", "/thumb?id=" + boost::lexical_cast<std::string>(local)
+                                 + "&gen=" + boost::lexical_cast<std::string>(generation->getSerial()));
             } 
             else if (method != RANDOM) {
                 json.add("tiny", "/search/thumb?id=" + id.toString());
@@ -789,25 +2780,107 @@ namespace nise {
             }
 
             json.add("id", id.toString())
+                .add("generation", generation->getSerial())
                 .add("time", time)
                 .add("num_results", results.size())
+                .add("num_candidates", ranking.candidates())
                 .add("page_offset", start)
-                .add("page_count", count)
-                .beginArray("page");
-            for (unsigned i = start; i < start + count; ++i) {
-                json.add(results[i]);
+                .add("page_count", count);
+        }
+
+    public:
+        void serve (std::ostream &os, unsigned start, unsigned count, const std::string &tag = "", bool binary = false) {
+            Poco::ScopedLock<Poco::Mutex> lock(mutex);
+
+            unsigned max_count = 0;
+            if (start < results.size()) {
+                max_count = results.size() - start;
+            }
+            // without page_count, the rest is served and there is no page
+            // to prefetch
+            bool paged = (count != 0);
+            if (count > max_count) count = max_count;
+            if (count == 0) count = max_count;
+
+            if ((method == IMAGE) && !done) {
+                served = std::max(served, start + count);
+            }
+
+            const ImageID *page = results.empty() ? 0 : &results[0] + start;
+            BackgroundFetcher *fetcher = BackgroundFetcher::instance();
+            if ((fetcher != 0) && (method != RANDOM) && paged && count) {
+                // this page and the next
+                unsigned end = std::min<unsigned>(start + 2 * count, results.size());
+                fetcher->prefetch(generation, page, &results[0] + end);
+            }
+            const unsigned *sizes = counts.empty() ? 0 : &counts[0] + start;
+            if (binary) {
+                BIN bin(os);
+                fields(bin, start, count, tag);
+                bin.addPage("page", page, page + count);
+                if (sizes) bin.addArray("counts", sizes, sizes + count);
+            }
+            else {
+                JSON json(os);
+                fields(json, start, count, tag);
+                json.addArray("page", page, page + count);
+                if (sizes) json.addArray("counts", sizes, sizes + count);
             }
-            json.endArray();
         }
     };
 
+    // Sessions by id.  A session is evicted when it has not been accessed
+    // for nise.session.expire miliseconds, or, least recently used first,
+    // when the sessions take more than nise.session.memory bytes.  The
+    // size of a session is charged again after each run.
     class SessionCache {
-        static Poco::AccessExpireCache<Poco::UUID, Session> *inst;
+        struct Entry {
+            Poco::UUID id;
+            Poco::SharedPtr<Session> session;
+            Poco::Timestamp access;
+            size_t bytes;
+        };
+        typedef std::list<Entry> List;
+
+        List lru;       // most recently used first
+        std::map<Poco::UUID, List::iterator> index;
+        Poco::Timestamp::TimeDiff expire;   // microseconds
+        size_t budget;
+        size_t total;
+        Poco::FastMutex mutex;
+
+        static SessionCache *inst;
+
+        SessionCache (unsigned expire_, size_t budget_)
+            : expire(Poco::Timestamp::TimeDiff(expire_) * 1000), budget(budget_), total(0) {
+        }
+
+        // Called with the mutex held.  The evicted sessions are destroyed
+        // by the caller, after the mutex is released.
+        void evict (std::vector<Poco::SharedPtr<Session> > *dropped) {
+            Poco::Timestamp now;
+            Metrics &metrics = Metrics::instance();
+            while (!lru.empty()) {
+                Entry &e = lru.back();
+                if (now - e.access >= expire) {
+                    metrics.session_expired.add();
+                }
+                else if ((total > budget) && (index.size() > 1)) {
+                    metrics.session_evicted.add();
+                }
+                else break;
+                total -= e.bytes;
+                dropped->push_back(e.session);
+                index.erase(e.id);
+                lru.pop_back();
+            }
+        }
+
     public:
         static void init (const Poco::Util::AbstractConfiguration &config) {
             BOOST_VERIFY(inst == 0);
-            inst = new Poco::AccessExpireCache<Poco::UUID, Session>(config.getInt("nise.session.expire",
-                                                                SESSION_EXPIRE_DEFAULT));
+            inst = new SessionCache(config.getInt("nise.session.expire", SESSION_EXPIRE_DEFAULT),
+                                    size_t(config.getInt("nise.session.memory", SESSION_MEMORY_DEFAULT)) << 20);
             Log::system().information("Session cache started.");
         }
 
@@ -818,35 +2891,224 @@ namespace nise {
             Log::system().information("Session cache stopped.");
         }
 
-        static Poco::AccessExpireCache<Poco::UUID, Session> &instance () {
-            
+        static SessionCache &instance () {
             return *inst;
         }
+
+        void add (const Poco::UUID &id, const Poco::SharedPtr<Session> &session) {
+            std::vector<Poco::SharedPtr<Session> > dropped;
+            size_t bytes = session->bytes();
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            std::map<Poco::UUID, List::iterator>::iterator it = index.find(id);
+            if (it != index.end()) {
+                total -= it->second->bytes;
+                dropped.push_back(it->second->session);
+                lru.erase(it->second);
+            }
+            Entry e;
+            e.id = id;
+            e.session = session;
+            e.bytes = bytes;
+            lru.push_front(e);
+            index[id] = lru.begin();
+            total += bytes;
+            evict(&dropped);
+        }
+
+        Poco::SharedPtr<Session> get (const Poco::UUID &id) {
+            std::vector<Poco::SharedPtr<Session> > dropped;
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            evict(&dropped);
+            std::map<Poco::UUID, List::iterator>::iterator it = index.find(id);
+            if (it == index.end()) return Poco::SharedPtr<Session>();
+            it->second->access.update();
+            lru.splice(lru.begin(), lru, it->second);
+            return lru.front().session;
+        }
+
+        // Updates the size of a session after it has run.
+        void charge (const Poco::SharedPtr<Session> &session) {
+            std::vector<Poco::SharedPtr<Session> > dropped;
+            size_t bytes = session->bytes();
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            std::map<Poco::UUID, List::iterator>::iterator it = index.find(session->getID());
+            if (it == index.end()) return;
+            total = total - it->second->bytes + bytes;
+            it->second->bytes = bytes;
+            evict(&dropped);
+        }
+
+        unsigned size () {
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            return index.size();
+        }
+
+        size_t getBytes () {
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            return total;
+        }
+
+        // get, counted in the metrics
+        static Poco::SharedPtr<Session> lookup (const Poco::UUID &id) {
+            Poco::SharedPtr<Session> session = inst->get(id);
+            if (session.isNull()) {
+                Metrics::instance().session_miss.add();
+            }
+            else {
+                Metrics::instance().session_hit.add();
+            }
+            return session;
+        }
     };
 
-    class BackgroundFetcher: public Poco::Runnable {
-        
-        bool done;
+    // Admission control of searches.  Searches in flight and the moving
+    // average of their latency decide a level for each new search:
+    //   DEGRADED:   no expansion or verification, fewer features
+    //   OVERLOADED: also batch mode, which has the best throughput
+    //   REJECTED:   over the hard limit, answered with 503
+    // Only pages that start a new image search are admitted; the others
+    // (thumbnails, metadata, static content, pages and updates of a
+    // session, local and random searches) bypass it, and the hard limit
+    // keeps some server threads free for them.
+    class Admission {
     public:
-        BackgroundFetcher (): done(false) {
-        }
+        enum Level {
+            NORMAL = 0,
+            DEGRADED,
+            OVERLOADED,
+            REJECTED
+        };
 
-        void stop () {
-            done = true;
+        // Holds weight slots, one per search, from admission to the end of
+        // the request.  Untimed tickets, e.g. of batch requests, are left
+        // out of the latency average.
+        class Ticket {
+            unsigned weight;
+            Level level;
+            bool timed;
+            Poco::Timestamp start;
+        public:
+            Ticket (bool timed_ = true, unsigned weight_ = 1)
+                : weight(inst->cap(weight_)), level(inst->enter(weight)), timed(timed_) {
+            }
+
+            ~Ticket () {
+                inst->leave(level, weight, timed ? start.elapsed() : -1);
+            }
+
+            Level getLevel () const {
+                return level;
+            }
+
+            void apply (Session::Parameter *param) const {
+                if (level >= DEGRADED) {
+                    param->expansion = false;
+                    param->verify = 0;
+                    if ((param->features == 0) || (param->features > inst->features)) {
+                        param->features = inst->features;
+                    }
+                }
+                if (level >= OVERLOADED) {
+                    param->batch = true;
+                }
+            }
+        };
+
+    private:
+        unsigned soft;          // in-flight searches before degrading
+        unsigned hard;          // in-flight searches before rejecting
+        float target;           // latency target, miliseconds
+        unsigned features;      // feature budget when degraded
+        unsigned retry;         // Retry-After, seconds
+        unsigned inflight;
+        float latency;          // moving average, miliseconds
+        Poco::FastMutex mutex;
+
+        static Admission *inst;
+
+        Admission (const Poco::Util::AbstractConfiguration &config, int threads)
+            : inflight(0), latency(0) {
+            int reserve = config.getInt("nise.admission.reserve", ADMISSION_RESERVE);
+            hard = config.getInt("nise.admission.hard", std::max(1, threads - reserve));
+            soft = config.getInt("nise.admission.soft", std::max(1U, hard / 2));
+            target = config.getInt("nise.admission.latency", ADMISSION_LATENCY);
+            features = config.getInt("nise.admission.features", ADMISSION_FEATURES);
+            retry = config.getInt("nise.admission.retry", 1);
+        }
+
+        // a request of more searches than the hard limit is taken as one
+        // of hard searches, so that it is admitted when the server is idle
+        unsigned cap (unsigned weight) const {
+            if (hard && (weight > hard)) return hard;
+            return std::max(weight, 1U);
+        }
+
+        Level enter (unsigned weight) {
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            unsigned n = inflight + weight;
+            Level level = NORMAL;
+            if (hard && (n > hard)) {
+                level = REJECTED;
+            }
+            else if ((soft && (n > (soft + hard + 1) / 2)) || (target && (latency > 2 * target))) {
+                level = OVERLOADED;
+            }
+            else if ((soft && (n > soft)) || (target && (latency > target))) {
+                level = DEGRADED;
+            }
+            Metrics &metrics = Metrics::instance();
+            switch (level) {
+                case NORMAL: break;
+                case DEGRADED: metrics.admit_degraded.add(); break;
+                case OVERLOADED: metrics.admit_overloaded.add(); break;
+                case REJECTED: metrics.admit_rejected.add(); return level;
+            }
+            inflight = n;
+            return level;
         }
 
-        void run () {
-            Log::system().information("Background fetcher started.");
-            while (!done) {
-#ifdef WIN32
-                Sleep(1000);
-#else
-                sleep(1);
-#endif
+        // elapsed < 0 if not timed
+        void leave (Level level, unsigned weight, Poco::Timestamp::TimeDiff elapsed) {
+            if (level == REJECTED) return;
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            inflight -= weight;
+            if (elapsed >= 0) {
+                latency = latency * 0.9F + elapsed / 1000.0F * 0.1F;
             }
-            Log::system().information("Background fetcher stopped.");
+        }
+
+    public:
+        // threads: # server threads handling requests
+        static void init (const Poco::Util::AbstractConfiguration &config, int threads) {
+            BOOST_VERIFY(inst == 0);
+            inst = new Admission(config, threads);
+            Log::system().information("Admission control started.");
+        }
+
+        static void cleanup (void) {
+            BOOST_VERIFY(inst != 0);
+            delete inst;
+            inst = 0;
+            Log::system().information("Admission control stopped.");
+        }
+
+        static Admission &instance () {
+            return *inst;
+        }
+
+        unsigned getRetry () const {
+            return retry;
+        }
+
+        unsigned getInflight () const {
+            return inflight;
+        }
+
+        float getLatency () const {
+            return latency;
         }
     };
+
 }
 
 
@@ -0,0 +1,149 @@
+#ifndef WDONG_NISE_VERIFY
+#define WDONG_NISE_VERIFY
+#include <cmath>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <boost/foreach.hpp>
+
+namespace nise {
+
+    // A similarity transform (scale, rotation and translation) mapping
+    // query regions to candidate regions.  One pair of matching regions
+    // determines it.
+    struct Similarity {
+        float a, b;     // s * cos(t), s * sin(t)
+        float x, y;
+        float ls;       // log(s)
+
+        Similarity (const Region &r1, const Region &r2) {
+            float s = r2.r / r1.r;
+            float t = r2.t - r1.t;
+            a = s * std::cos(t);
+            b = s * std::sin(t);
+            x = r2.x - (a * r1.x - b * r1.y);
+            y = r2.y - (b * r1.x + a * r1.y);
+            ls = std::log(s);
+        }
+    };
+
+    // Geometric verification of a candidate against the query, similar to
+    // MatchTrue in expr/sim.cpp: the features are matched one to one, each
+    // to its mutual nearest neighbor by sketch distance, a similarity
+    // transform is fitted to the matched regions with RANSAC, and the
+    // number of inliers is the score.
+    class GeometricVerifier {
+        unsigned dist;
+        unsigned iterations;
+        float position;     // tolerance relative to the candidate size
+        float scale;        // tolerance of |log scale ratio|
+
+        // The matches in structure-of-arrays layout, so that the inlier
+        // count of a hypothesis is a single vectorizable loop.
+        struct Matches {
+            std::vector<float> x1, y1, ls1;
+            std::vector<float> x2, y2, ls2;
+            std::vector<unsigned> q, c;
+
+            void add (const Region &r1, const Region &r2, unsigned i, unsigned j) {
+                x1.push_back(r1.x);
+                y1.push_back(r1.y);
+                ls1.push_back(std::log(r1.r));
+                x2.push_back(r2.x);
+                y2.push_back(r2.y);
+                ls2.push_back(std::log(r2.r));
+                q.push_back(i);
+                c.push_back(j);
+            }
+
+            unsigned size () const {
+                return q.size();
+            }
+        };
+
+        static void unpack (const std::vector<Feature> &features, std::vector<uint64_t> *words) {
+            words->resize(features.size() * 2);
+            if (features.size()) {
+                std::memcpy(&words->at(0), &features[0], features.size() * sizeof(Feature));
+            }
+        }
+
+        unsigned inliers (const Matches &m, const Similarity &tr, float tol2) const {
+            unsigned n = m.size();
+            const float *x1 = &m.x1[0], *y1 = &m.y1[0], *ls1 = &m.ls1[0];
+            const float *x2 = &m.x2[0], *y2 = &m.y2[0], *ls2 = &m.ls2[0];
+            unsigned cnt = 0;
+            for (unsigned i = 0; i < n; ++i) {
+                float dx = tr.a * x1[i] - tr.b * y1[i] + tr.x - x2[i];
+                float dy = tr.b * x1[i] + tr.a * y1[i] + tr.y - y2[i];
+                float ds = std::fabs(ls1[i] + tr.ls - ls2[i]);
+                cnt += ((dx * dx + dy * dy <= tol2) & (ds <= scale)) ? 1 : 0;
+            }
+            return cnt;
+        }
+
+    public:
+        GeometricVerifier (unsigned dist_ = SKETCH_DIST,
+                           unsigned iterations_ = VERIFY_ITERATIONS,
+                           float position_ = VERIFY_POSITION_TOLERANCE,
+                           float scale_ = VERIFY_SCALE_TOLERANCE)
+            : dist(dist_), iterations(iterations_), position(position_), scale(scale_) {
+        }
+
+        unsigned verify (const Record &query, const Record &cand) const {
+            if (query.regions.size() != query.features.size()) return 0;
+            if (cand.regions.size() != cand.features.size()) return 0;
+
+            std::vector<uint64_t> w1, w2;
+            unpack(query.features, &w1);
+            unpack(cand.features, &w2);
+
+            // nearest neighbors within dist both ways, so that a feature
+            // repeated on either side is matched only once
+            unsigned n1 = query.features.size(), n2 = cand.features.size();
+            std::vector<std::pair<unsigned, unsigned> > best1(n1, std::make_pair(dist, n2));
+            std::vector<std::pair<unsigned, unsigned> > best2(n2, std::make_pair(dist, n1));
+            for (unsigned i = 0; i < n1; ++i) {
+                if (query.regions[i].r <= 0) continue;
+                uint64_t a0 = w1[2 * i], a1 = w1[2 * i + 1];
+                for (unsigned j = 0; j < n2; ++j) {
+                    if (cand.regions[j].r <= 0) continue;
+                    unsigned d = __builtin_popcountll(a0 ^ w2[2 * j])
+                               + __builtin_popcountll(a1 ^ w2[2 * j + 1]);
+                    if (d < best1[i].first) best1[i] = std::make_pair(d, j);
+                    if (d < best2[j].first) best2[j] = std::make_pair(d, i);
+                }
+            }
+            Matches m;
+            for (unsigned i = 0; i < n1; ++i) {
+                unsigned j = best1[i].second;
+                if ((j < n2) && (best2[j].second == i)) {
+                    m.add(query.regions[i], cand.regions[j], i, j);
+                }
+            }
+            if (m.size() == 0) return 0;
+
+            float tol = position * std::max(cand.meta.width, cand.meta.height);
+            float tol2 = tol * tol;
+
+            // deterministic sampling, a candidate always gets the same score
+            unsigned best = 0;
+            unsigned seed = m.size();
+            unsigned trials = std::min<unsigned>(iterations, m.size());
+            for (unsigned k = 0; k < trials; ++k) {
+                unsigned l = k;
+                if (trials < m.size()) {
+                    seed = seed * 1103515245 + 12345;
+                    l = (seed >> 8) % m.size();
+                }
+                Similarity tr(query.regions[m.q[l]], cand.regions[m.c[l]]);
+                unsigned c = inliers(m, tr, tol2);
+                if (c > best) best = c;
+            }
+            return best;
+        }
+    };
+}
+
+#endif
+
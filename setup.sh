@@ -10,7 +10,7 @@ then
 fi
 
 
-BIN_FILES="index/merge index/number index/graph-hash index/graph-join index/mapid index/sketch-index index/group index/group-index index/import index/import-nutch extract/extract index/download index/graph index/import-id index/cluster2id index/graph-index"
+BIN_FILES="index/merge index/number index/graph-hash index/graph-join index/mapid index/sketch-index index/group index/group-index index/import index/import-nutch extract/extract index/download index/graph index/import-id index/cluster2id index/cluster-index index/graph-index index/graph-nibble"
 
 SBIN_FILES="server/server"
 JAVA_FILES="java/*.jar"
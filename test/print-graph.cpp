@@ -1,19 +1,25 @@
 #include "../common/nise.h"
+#include "../server/expand.h"
 
 using namespace std;
 using namespace nise;
 
+// print-graph <graph>: one line per vertex with neighbors, "v n1 n2 ...".
+// Reads both the CSR format and the old list format through nise::Graph.
 int main (int argc, char *argv[]) {
-    ImageID key;
-    std::vector<ImageID> value;
-    for (;;) {
-        key = ReadUint32(cin);
-        ReadVector<ImageID>(cin, &value);
-        if (!cin) break;
-        cout << key;
-        BOOST_FOREACH(ImageID v, value) {
-            cout << ' ' << v; 
+    if (argc < 2) {
+        cerr << "usage: " << argv[0] << " <graph>" << endl;
+        return 1;
+    }
+    Graph graph(argv[1]);
+    for (ImageID v = 0; v < graph.slots(); ++v) {
+        Graph::Range range = graph.get(v);
+        if (range.first == range.second) continue;
+        cout << v;
+        for (const ImageID *p = range.first; p < range.second; ++p) {
+            cout << ' ' << *p;
         }
         cout << endl;
     }
+    return 0;
 }
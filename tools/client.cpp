@@ -1,4 +1,5 @@
 #include <sstream>
+#include <cstring>
 #include <boost/program_options.hpp>
 #include <boost/lexical_cast.hpp>
 #include <Poco/Runnable.h>
@@ -24,6 +25,7 @@
 #include <Poco/NullStream.h>
 #include <Poco/Exception.h>
 #include "../common/nise.h"
+#include "../server/json.h"
 
 namespace po = boost::program_options; 
 
@@ -185,6 +187,73 @@ public:
     }
 };
 
+// Converts a format=bin response (see BIN in server/json.h) back to the
+// JSON text the server would have sent, and extracts the page.
+static bool DecodeResult (const std::string &bin, std::ostream &os, std::vector<nise::ImageID> *page) {
+    const char *p = bin.data();
+    const char *end = p + bin.size();
+    if ((end - p < 4) || !nise::Signature::RESULT.check(*reinterpret_cast<const uint32_t *>(p))) return false;
+    p += 4;
+    nise::JSON json(os);
+    while (p < end) {
+        uint64_t len;
+        if (!nise::ParseVarint(&p, end, &len) || (uint64_t(end - p) < len + 1)) return false;
+        std::string key(p, len);
+        p += len;
+        char type = *p++;
+        if (type == 'b') {
+            if (p >= end) return false;
+            json.add(key, *p++ != 0);
+        }
+        else if (type == 'i') {
+            int64_t v;
+            if (!nise::ParseVarintSigned(&p, end, &v)) return false;
+            json.add(key, (long long)v);
+        }
+        else if (type == 'f') {
+            float v;
+            if (end - p < int(sizeof(v))) return false;
+            std::memcpy(&v, p, sizeof(v));
+            p += sizeof(v);
+            json.add(key, v);
+        }
+        else if (type == 's') {
+            if (!nise::ParseVarint(&p, end, &len) || (uint64_t(end - p) < len)) return false;
+            json.add(key, std::string(p, len));
+            p += len;
+        }
+        else if (type == 'p') {
+            uint64_t n, v;
+            if (!nise::ParseVarint(&p, end, &n) || (uint64_t(end - p) < 2 * n)) return false;
+            std::vector<nise::ImageID> sorted(n);
+            nise::ImageID prev = 0;
+            for (unsigned i = 0; i < n; ++i) {
+                if (!nise::ParseVarint(&p, end, &v)) return false;
+                prev += v;
+                sorted[i] = prev;
+            }
+            page->resize(n);
+            for (unsigned i = 0; i < n; ++i) {
+                if (!nise::ParseVarint(&p, end, &v) || (v >= n)) return false;
+                page->at(v) = sorted[i];
+            }
+            json.addArray(key, page->data(), page->data() + n);
+        }
+        else if (type == 'a') {
+            uint64_t n, v;
+            if (!nise::ParseVarint(&p, end, &n) || (uint64_t(end - p) < n)) return false;
+            std::vector<unsigned> array(n);
+            for (unsigned i = 0; i < n; ++i) {
+                if (!nise::ParseVarint(&p, end, &v)) return false;
+                array[i] = v;
+            }
+            json.addArray(key, array.data(), array.data() + n);
+        }
+        else return false;
+    }
+    return true;
+}
+
 class Worker: public Poco::Runnable {
     std::string uri;
     std::string server;
@@ -192,8 +261,25 @@ class Worker: public Poco::Runnable {
     Poco::NotificationQueue &outQueue;
     bool meta;
     bool thumb;
+    bool binary;
+    unsigned batch;
     bool *flag;
 
+    void makeMoreQueries (const std::vector<nise::ImageID> &page, const std::string &tag) {
+        BOOST_FOREACH(nise::ImageID id, page) {
+            if (meta) {
+                Job* job = new Job(Job::META, id);
+                job->setTag(tag);
+                inQueue.enqueueUrgentNotification(job);
+            }
+            if (thumb) {
+                Job* job = new Job(Job::THUMB, id);
+                job->setTag(tag);
+                inQueue.enqueueUrgentNotification(job);
+            }
+        }
+    }
+
     void makeMoreQueries (const std::string &json, const std::string &tag) {
         size_t off = json.find("\"page\":[");
         if (off == json.npos) return;
@@ -221,9 +307,88 @@ class Worker: public Poco::Runnable {
             }
         }
     }
+    static bool batchable (const Job &job) {
+        return (job.getType() == Job::IMAGE) || (job.getType() == Job::RECORD);
+    }
+
+    // Sends the images and records of jobs to /search/batch in one
+    // request.  The server tags the results by position, which are put
+    // back to the tags of the jobs.
+    void runBatch (const Poco::URI &server, const std::vector<Poco::AutoPtr<Job> > &jobs) {
+        std::ostringstream body(std::ios::binary);
+        BOOST_FOREACH(const Poco::AutoPtr<Job> &job, jobs) {
+            if (job->getType() == Job::RECORD) {
+                body << job->getString();   // already framed
+            }
+            else {
+                nise::Signature::IMAGE.write(body);
+                nise::WriteUint32(body, job->getString().size());
+                body << job->getString();
+            }
+        }
+
+        Poco::Net::HTTPClientSession session(server.getHost(), server.getPort());
+        Poco::Net::HTTPRequest req(Poco::Net::HTTPRequest::HTTP_POST, "/search/batch", Poco::Net::HTTPMessage::HTTP_1_1);
+        Poco::Net::HTMLForm form;
+        form.setEncoding(Poco::Net::HTMLForm::ENCODING_MULTIPART);
+        form.add("log", "0");
+        if (binary) {
+            form.add("format", "bin");
+        }
+        form.addPart("form-data",
+                new Poco::Net::StringPartSource(
+                    body.str(),
+                    "application/octet-stream",
+                    "filename"));
+        form.prepareSubmit(req);
+        form.write(session.sendRequest(req));
+
+        Poco::Net::HTTPResponse res;
+        std::istream& rs = session.receiveResponse(res);
+        if (res.getStatus() != Poco::Net::HTTPResponse::HTTP_OK) {
+            std::string txt;
+            Poco::StreamCopier::copyToString(rs, txt);
+            std::cerr << "batch failed: " << res.getStatus() << ' ' << txt << std::endl;
+            return;
+        }
+        for (unsigned i = 0; i < jobs.size(); ++i) {
+            std::string txt;
+            std::vector<nise::ImageID> page;
+            bool decoded = false;
+            if (binary) {
+                uint32_t len = nise::ReadUint32(rs);
+                if (!rs) break;
+                std::string bin(len, 0);
+                if (len) rs.read(&bin[0], len);
+                std::ostringstream ss;
+                decoded = DecodeResult(bin, ss, &page);
+                if (!decoded) {
+                    std::cerr << "bad binary response" << std::endl;
+                    break;
+                }
+                txt = ss.str();
+            }
+            else if (!std::getline(rs, txt)) break;
+            const std::string &tag = jobs[i]->getTag();
+            std::string item = "\"tag\":\"" + boost::lexical_cast<std::string>(i) + '"';
+            size_t off = txt.find(item);
+            if (off != txt.npos) {
+                txt.replace(off, item.size(), "\"tag\":\"" + tag + '"');
+            }
+            Poco::Notification::Ptr out = new Output(txt);
+            outQueue.enqueueNotification(out);
+            if (decoded) {
+                makeMoreQueries(page, tag);
+            }
+            else {
+                makeMoreQueries(txt, tag);
+            }
+        }
+    }
+
 public:
-    Worker (const std::string &serv, Poco::NotificationQueue &in, Poco::NotificationQueue &out, bool me, bool th, bool *f)
-        : uri(serv), inQueue(in), outQueue(out), meta(me), thumb(th), flag(f) {
+    Worker (const std::string &serv, Poco::NotificationQueue &in, Poco::NotificationQueue &out, bool me, bool th, bool bin, unsigned ba, bool *f)
+        : uri(serv), inQueue(in), outQueue(out), meta(me), thumb(th), binary(bin), batch(ba), flag(f) {
     }
 
     void run () {
@@ -236,6 +401,22 @@ public:
                 if (*flag) break;
                 continue;
             }
+            if ((batch > 1) && batchable(*job)) {
+                std::vector<Poco::AutoPtr<Job> > jobs(1, job);
+                while (jobs.size() < batch) {
+                    Poco::AutoPtr<Job> next = dynamic_cast<Job *>(inQueue.dequeueNotification());
+                    if (next.isNull()) break;
+                    if (!batchable(*next)) {
+                        // meta and thumb queries go back to the front
+                        Poco::Notification::Ptr back(next.get(), true);
+                        inQueue.enqueueUrgentNotification(back);
+                        break;
+                    }
+                    jobs.push_back(next);
+                }
+                runBatch(server, jobs);
+                continue;
+            }
             Poco::Net::HTTPClientSession session(server.getHost(), server.getPort());
 
             Poco::Net::HTTPRequest req(Poco::Net::HTTPMessage::HTTP_1_1);
@@ -288,6 +469,10 @@ public:
                 form.add("id", boost::lexical_cast<std::string>(job->getID()));
             }
 
+            if (binary && (job->getType() != Job::META) && (job->getType() != Job::THUMB)) {
+                form.add("format", "bin");
+            }
+
             form.prepareSubmit(req);
             form.write(session.sendRequest(req));
 
@@ -295,12 +480,29 @@ public:
             std::istream& rs = session.receiveResponse(res);
             std::string txt;
             Poco::StreamCopier::copyToString(rs, txt);
+            std::vector<nise::ImageID> page;
+            bool decoded = false;
+            if (binary && (res.getContentType() == "application/octet-stream")) {
+                std::ostringstream ss;
+                decoded = DecodeResult(txt, ss, &page);
+                if (decoded) {
+                    txt = ss.str();
+                }
+                else {
+                    std::cerr << "bad binary response" << std::endl;
+                }
+            }
             if (job->getType() != Job::THUMB) {
                 Poco::Notification::Ptr out = new Output(txt);
                 outQueue.enqueueNotification(out);
             }
             if ((job->getType() == Job::IMAGE) || (job->getType() == Job::RECORD)) {
-                makeMoreQueries(txt, job->getTag());
+                if (decoded) {
+                    makeMoreQueries(page, job->getTag());
+                }
+                else {
+                    makeMoreQueries(txt, job->getTag());
+                }
             }
         }
     }
@@ -312,6 +514,8 @@ int main(int argc, char **argv) {
     int num_threads;
     int meta;
     int thumb;
+    int binary;
+    unsigned batch;
 
     po::options_description desc("Allowed options");
     desc.add_options()
@@ -321,6 +525,8 @@ int main(int argc, char **argv) {
     ("thread", po::value(&num_threads)->default_value(1), "")
     ("meta", po::value(&meta)->default_value(0), "")
     ("thumb", po::value(&thumb)->default_value(0), "")
+    ("bin", po::value(&binary)->default_value(0), "request results in the binary format")
+    ("batch", po::value(&batch)->default_value(1), "send up to this many images or records per request to /search/batch")
     ;
 
     po::variables_map vm;
@@ -346,7 +552,7 @@ int main(int argc, char **argv) {
         Poco::Thread* pt = new Poco::Thread;
         poco_check_ptr(pt);
         threads.push_back(pt);
-        Worker* worker = new Worker(url, inQueue, outQueue, meta, thumb, &input_done);
+        Worker* worker = new Worker(url, inQueue, outQueue, meta, thumb, binary, batch, &input_done);
         poco_check_ptr(worker);
         workers.push_back(worker);
         pt->start(*worker);
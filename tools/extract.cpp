@@ -22,11 +22,13 @@ namespace po = boost::program_options;
 int main(int argc, char **argv) {
 
     bool input_list = false;
+    string projection;
 
     po::options_description desc("Allowed options");
     desc.add_options()
     ("help,h", "produce help message.")
     ("list", "read a list of paths from stdin")
+    ("projection", po::value(&projection), "check the LSH projection against this file, or save it there")
     ;
 
     po::positional_options_description p;
@@ -45,6 +47,11 @@ int main(int argc, char **argv) {
         input_list = true;
     }
 
+    if (!projection.empty() && !Extractor::checkProjection(projection)) {
+        cerr << "LSH projection differs from " << projection << endl;
+        return 1;
+    }
+
     Extractor xtor;
 
     for (;;) {